@@ -0,0 +1,487 @@
+// The simulated exchange: the market book the order manager's sends land on, the verifier that
+// rebuilds it from the outbound stream, and, for virtual time runs, the clock and the acks it sends back.
+#pragma once
+
+#include <atomic>
+#include <fstream>
+#include <iomanip>
+#include <numeric>
+#include <pthread.h>
+#include <queue>
+#include <sstream>
+#include <string>
+#include <thread>
+
+#include "order_types.h"
+
+// Virtual clock for discrete event runs (--virtual), in nanoseconds. Strategy actions arrive at random,
+// the throttle window reopens on a fixed period and each send is acked after a latency drawn from the
+// AckLatencyProfile: fixed, lognormal or an empirical histogram, plus an extra latency while a spike is
+// under way on the session. Each session acks in send order, so a quick ack waits behind a slow one.
+// Latencies and bursts therefore have a duration rather than a loop count.
+using VirtualTime = int64_t;
+const VirtualTime ThrottleWindowLength = 100'000'000;
+const VirtualTime MeanActionInterval = 20'000'000; // between bursts of strategy actions
+
+enum class AckLatencyModel : uint8_t
+{
+  Fixed,
+  Lognormal,
+  Histogram // empirical, e.g. measured on the venue
+};
+
+// How long the exchange takes to ack a send in virtual time runs, see --ack-latency and --ack-spikes
+struct AckLatencyProfile
+{
+  AckLatencyModel model = AckLatencyModel::Fixed;
+  VirtualTime median = 2'000'000; // the fixed latency, or the lognormal median
+  double sigma = 0.5; // lognormal shape
+  std::vector<VirtualTime> histogramLatencies;
+  std::discrete_distribution<size_t> histogramWeights; // one per histogram latency
+  double spikeLikelihood = 0; // that a send starts a spike on its session, if none is under way
+  VirtualTime spikeLatency = 50'000'000; // added to every ack on the session while the spike lasts
+  VirtualTime spikeLength = 200'000'000;
+};
+
+enum class EventType : uint8_t
+{
+  StrategyAction,
+  WindowReopen,
+  AckArrival
+};
+
+struct Event
+{
+  VirtualTime at;
+  uint64_t sequence; // events due at the same time run in the order they were scheduled
+  EventType type;
+  OperationHandle operation; // acked by an AckArrival
+};
+
+struct EventLater
+{
+  bool operator()(const Event& left, const Event& right) const
+  {
+    return left.at != right.at ? left.at > right.at : left.sequence > right.sequence;
+  }
+};
+
+// Reads "<microseconds> <weight>" lines, skipping blank lines and # comments
+inline bool LoadAckLatencyHistogram(const std::string& path, AckLatencyProfile& ackLatency)
+{
+  std::ifstream file(path);
+  std::vector<double> weights;
+  ackLatency.histogramLatencies.clear();
+  std::string line;
+  while (std::getline(file, line))
+  {
+    if (line.empty() || line[0] == '#')
+      continue;
+    std::istringstream fields(line);
+    double microseconds, weight;
+    if (!(fields >> microseconds >> weight) || microseconds < 0 || weight < 0)
+      return false;
+    ackLatency.histogramLatencies.push_back(VirtualTime(microseconds * 1000));
+    weights.push_back(weight);
+  }
+  if (std::accumulate(weights.begin(), weights.end(), 0.0) <= 0)
+    return false; // nothing to draw from
+  ackLatency.model = AckLatencyModel::Histogram;
+  ackLatency.histogramWeights = std::discrete_distribution<size_t>(weights.begin(), weights.end());
+  return true;
+}
+
+// fixed:<microseconds>, lognormal:<median microseconds>:<sigma> or histogram:<file>
+inline bool ParseAckLatency(const std::string& spec, AckLatencyProfile& ackLatency)
+{
+  std::istringstream fields(spec);
+  std::string model;
+  std::getline(fields, model, ':');
+  if (model == "histogram")
+  {
+    std::string path;
+    std::getline(fields, path);
+    return LoadAckLatencyHistogram(path, ackLatency);
+  }
+  double microseconds;
+  if (!(fields >> microseconds) || microseconds < 0)
+    return false;
+  ackLatency.median = VirtualTime(microseconds * 1000);
+  if (model == "fixed")
+  {
+    ackLatency.model = AckLatencyModel::Fixed;
+    return fields.eof();
+  }
+  char separator;
+  if (model != "lognormal" || !(fields >> separator >> ackLatency.sigma) || separator != ':' || ackLatency.median == 0 || ackLatency.sigma <= 0)
+    return false;
+  ackLatency.model = AckLatencyModel::Lognormal;
+  return true;
+}
+
+// <likelihood per send>:<extra microseconds>:<length microseconds>
+inline bool ParseAckSpikes(const std::string& spec, AckLatencyProfile& ackLatency)
+{
+  std::istringstream fields(spec);
+  double extra, length;
+  char separator1, separator2;
+  if (!(fields >> ackLatency.spikeLikelihood >> separator1 >> extra >> separator2 >> length) || separator1 != ':' || separator2 != ':')
+    return false;
+  ackLatency.spikeLatency = VirtualTime(extra * 1000);
+  ackLatency.spikeLength = VirtualTime(length * 1000);
+  return ackLatency.spikeLikelihood >= 0 && ackLatency.spikeLikelihood <= 1;
+}
+
+// total qty shown at each price level
+struct DepthBook
+{
+  std::array<int, UpperPrice + 1> bids {};
+  std::array<int, UpperPrice + 1> asks {};
+};
+
+struct DepthLevel
+{
+  int price;
+  int qty;
+};
+
+struct DepthDelta
+{
+  Side side;
+  int16_t price;
+  int32_t qty; // negative when qty leaves the level
+};
+
+// A send as seen on the wire: the qty it takes off the book (the operation it replaces) and the qty
+// it adds. sequence is the replay position, i.e. the number of sends before this one.
+struct MarketMessage
+{
+  long sequence;
+  int deltaCount;
+  std::array<DepthDelta, 4> deltas; // two legs replaced, two legs added
+};
+
+// Lock free ring with exactly one pushing and one popping thread
+template <typename T, size_t Capacity>
+class SpscRing
+{
+public:
+  bool TryPush(const T& item)
+  {
+    size_t currentTail = tail.load(std::memory_order_relaxed);
+    if (currentTail - head.load(std::memory_order_acquire) == Capacity)
+      return false; // full
+    items[currentTail % Capacity] = item;
+    tail.store(currentTail + 1, std::memory_order_release);
+    return true;
+  }
+
+  bool TryPop(T& item)
+  {
+    size_t currentHead = head.load(std::memory_order_relaxed);
+    if (currentHead == tail.load(std::memory_order_acquire))
+      return false; // empty
+    item = items[currentHead % Capacity];
+    head.store(currentHead + 1, std::memory_order_release);
+    return true;
+  }
+
+private:
+  std::array<T, Capacity> items;
+  alignas(64) std::atomic<size_t> head {0}; // next item to pop
+  alignas(64) std::atomic<size_t> tail {0}; // next slot to push
+};
+
+// records the qty an operation on an order on `side` starts (direction 1) or stops (direction -1) showing
+inline void AddDepthDeltas(MarketMessage& message, const Operation& operation, Side side, int direction)
+{
+  if (IsQuote(operation))
+  {
+    if (operation.quotePayload.bidQty > -1)
+      message.deltas[message.deltaCount++] = DepthDelta{Side::Buy, operation.quotePayload.bidPrice, direction * operation.quotePayload.bidQty};
+    if (operation.quotePayload.askQty > -1)
+      message.deltas[message.deltaCount++] = DepthDelta{Side::Sell, operation.quotePayload.askPrice, direction * operation.quotePayload.askQty};
+  }
+  else
+  {
+    message.deltas[message.deltaCount++] = DepthDelta{side, operation.orderPayload.price, direction * operation.orderPayload.qty};
+  }
+}
+
+inline void ApplyToDepth(DepthBook& book, const MarketMessage& message)
+{
+  for (int i = 0; i < message.deltaCount; ++i)
+  {
+    const DepthDelta& delta = message.deltas[i];
+    (delta.side == Side::Buy ? book.bids : book.asks)[delta.price] += delta.qty;
+  }
+}
+
+class ExchangeSimulator
+{
+public:
+  explicit ExchangeSimulator(DecisionSource& random_engine)
+    : random_engine(random_engine)
+  {
+  }
+
+  ExchangeSimulator(const ExchangeSimulator&) = delete;
+  ExchangeSimulator& operator=(const ExchangeSimulator&) = delete;
+
+  ~ExchangeSimulator()
+  {
+    if (verifier.joinable())
+      StopVerifier();
+  }
+
+  // Puts a send on the book, streams it to the verifier and, in virtual time runs, schedules its ack.
+  // operationSlots is the sending order manager's and header that of the operation's order.
+  void Send(OperationHandle handle, const SlotMap<Operation>& operationSlots, const OrderHeader& header)
+  {
+    const Operation& operation = operationSlots[handle];
+    if (virtualTime)
+      ScheduleEvent(AckDue(header.session), EventType::AckArrival, handle); // same due time acks in send order
+
+    MarketMessage message;
+    message.sequence = marketMessageSequence++;
+    message.deltaCount = 0;
+
+    // the previous operation overwrites the last
+    if (operation.previousOperation)
+    {
+        const Operation& previousOperation = operationSlots[operation.previousOperation];
+        auto it = std::find(marketOperations.begin(), marketOperations.end(), operation.previousOperation);
+        if (it == marketOperations.end())
+        {
+          std::cout << "Can't find existing operation in market book: " << previousOperation << std::endl;
+          throw;
+        }
+        AddDepthDeltas(message, previousOperation, header.side, -1);
+        marketOperations.erase(it);
+    }
+    // add inserts and amends (a delete will have already cleared last item)
+    if (operation.operationType == OperationType::InsertOrder || operation.operationType == OperationType::AmendOrder || operation.operationType == OperationType::InsertQuote)
+    {
+      marketOperations.push_back(handle); // includes quotes
+      AddDepthDeltas(message, operation, header.side, 1);
+    }
+
+    ApplyToDepth(marketDepth, message);
+    // the verifier is behind and dropping a message would make its book diverge, so wait for room,
+    // unless it has stopped at a cross and will never make any
+    while (verifierRunning && verifierFailedAt.load(std::memory_order_acquire) < 0 && !outboundMessages.TryPush(message))
+      std::this_thread::yield();
+
+    if (bookRenderInterval && ++sendsSinceBookRender >= bookRenderInterval)
+    {
+      sendsSinceBookRender = 0;
+      PrintOrderBook();
+    }
+  }
+
+  // the operation handles of everything showing, one per order
+  const std::vector<OperationHandle>& MarketOperations() const
+  {
+    return marketOperations;
+  }
+
+  // the order manager's view of the market, kept in step with the market operations
+  const DepthBook& Depth() const
+  {
+    return marketDepth;
+  }
+
+  // Copies up to maxLevels non-empty levels of one side, best price first, into levels. Returns the
+  // number of levels copied.
+  int GetDepthSnapshot(Side side, DepthLevel* levels, int maxLevels) const
+  {
+    int count = 0;
+    if (side == Side::Buy)
+    {
+      for (int price = UpperPrice; price > 0 && count < maxLevels; --price)
+        if (marketDepth.bids[price])
+          levels[count++] = DepthLevel{price, marketDepth.bids[price]};
+    }
+    else
+    {
+      for (int price = 1; price <= UpperPrice && count < maxLevels; ++price)
+        if (marketDepth.asks[price])
+          levels[count++] = DepthLevel{price, marketDepth.asks[price]};
+    }
+    return count;
+  }
+
+  void PrintOrderBook() const
+  {
+    //std::cout << "\033[2J\033[1;1H"; // clear screen
+    for (int price = UpperPrice; price > 0; --price)
+    {
+      std::stringstream bidPrice;
+      if (marketDepth.bids[price])
+        bidPrice << std::right << std::setfill(' ') << std::setw(5) << marketDepth.bids[price];
+      else
+        bidPrice << std::right << std::setfill(' ') << std::setw(5) << ' ';
+      std::cout << bidPrice.str() << " " << price << " ";
+      std::stringstream askPrice;
+      if (marketDepth.asks[price])
+        askPrice << std::left << std::setfill(' ') << std::setw(5) << marketDepth.asks[price];
+      else
+        askPrice << std::left << std::setfill(' ') << std::setw(5) << ' ';
+      std::cout << askPrice.str() << std::endl;
+    }
+  }
+
+  // Checks the cross invariant on its own thread from now on, pinned to the given core if there is one.
+  // Returns false if it couldn't be pinned, in which case it runs wherever the scheduler puts it.
+  bool StartVerifier(int core = -1)
+  {
+    verifierRunning = true;
+    verifier = std::thread(&ExchangeSimulator::RunVerifier, this);
+    if (core < 0)
+      return true;
+    if (core >= CPU_SETSIZE)
+      return false;
+    cpu_set_t cores;
+    CPU_ZERO(&cores);
+    CPU_SET(core, &cores);
+    return pthread_setaffinity_np(verifier.native_handle(), sizeof(cores), &cores) == 0;
+  }
+
+  // lets the verifier drain the stream before the final verdict
+  void StopVerifier()
+  {
+    verifierStopping.store(true, std::memory_order_release);
+    verifier.join();
+    verifierRunning = false;
+  }
+
+  void CheckVerifier() const
+  {
+    long failedAt = verifierFailedAt.load(std::memory_order_acquire);
+    if (failedAt < 0)
+      return;
+    std::cout << "********* IN CROSS at price level " << verifierFailedPrice.load(std::memory_order_relaxed)
+              << " after message " << failedAt << " ************" << std::endl;
+    exit(-1);
+  }
+
+  void ScheduleEvent(VirtualTime at, EventType type, OperationHandle operation = OperationHandle())
+  {
+    events.push(Event{at, eventsScheduled++, type, operation});
+  }
+
+  bool EventDue(VirtualTime until) const
+  {
+    return !events.empty() && (until == 0 || events.top().at <= until);
+  }
+
+  // moves the clock on to the next event and returns it
+  Event NextEvent()
+  {
+    Event event = events.top();
+    events.pop();
+    virtualNow = event.at;
+    return event;
+  }
+
+  VirtualTime Now() const
+  {
+    return virtualNow;
+  }
+
+  // render the book every this many sends, 0 to only render on request
+  int bookRenderInterval = 1;
+  bool virtualTime = false; // acks come from scheduled events rather than AckOrderOperations
+  AckLatencyProfile ackLatency;
+  long ackLatencySpikes = 0;
+
+private:
+  // The simulator's correctness oracle: we must never show a bid and an ask at the same level. Rebuilds
+  // the book from the outbound stream rather than trusting the order manager's own view, and stops at
+  // the first cross. Nothing is sampled: skipping a message would leave the book wrong from then on, and
+  // checking the levels a message touched is only a few compares on top of applying it.
+  void RunVerifier()
+  {
+    DepthBook book;
+    MarketMessage message;
+    while (true)
+    {
+      bool stopping = verifierStopping.load(std::memory_order_acquire);
+      if (!outboundMessages.TryPop(message))
+      {
+        if (stopping)
+          return; // drained
+        std::this_thread::yield();
+        continue;
+      }
+      ApplyToDepth(book, message);
+      for (int i = 0; i < message.deltaCount; ++i)
+      {
+        int price = message.deltas[i].price;
+        if (book.bids[price] && book.asks[price])
+        {
+          verifierFailedPrice.store(price, std::memory_order_relaxed);
+          verifierFailedAt.store(message.sequence, std::memory_order_release);
+          return;
+        }
+      }
+    }
+  }
+
+  // when the exchange acks an operation sent on the session now
+  VirtualTime AckDue(size_t sessionIndex)
+  {
+    SessionLatency& session = sessionLatency[sessionIndex];
+    VirtualTime latency = ackLatency.median;
+    if (ackLatency.model == AckLatencyModel::Lognormal)
+    {
+      std::lognormal_distribution<> distribution(std::log(double(ackLatency.median)), ackLatency.sigma);
+      latency = VirtualTime(distribution(random_engine));
+    }
+    else if (ackLatency.model == AckLatencyModel::Histogram)
+    {
+      latency = ackLatency.histogramLatencies[ackLatency.histogramWeights(random_engine)];
+    }
+    if (ackLatency.spikeLikelihood > 0 && virtualNow >= session.spikeUntil)
+    {
+      std::bernoulli_distribution distribution(ackLatency.spikeLikelihood);
+      if (distribution(random_engine))
+      {
+        session.spikeUntil = virtualNow + ackLatency.spikeLength;
+        ++ackLatencySpikes;
+      }
+    }
+    if (virtualNow < session.spikeUntil)
+      latency += ackLatency.spikeLatency;
+    // the exchange acks a session's sends in order, so a quick ack waits behind a slow one
+    session.lastAckDue = std::max(virtualNow + latency, session.lastAckDue);
+    return session.lastAckDue;
+  }
+
+  // the exchange's side of a session
+  struct SessionLatency
+  {
+    VirtualTime lastAckDue = 0; // the latest ack on the session arrives then, acks come back in order
+    VirtualTime spikeUntil = 0; // the session's current latency spike ends then
+  };
+
+  DecisionSource& random_engine;
+  std::priority_queue<Event, std::vector<Event>, EventLater> events;
+  VirtualTime virtualNow = 0;
+  uint64_t eventsScheduled = 0;
+  std::array<SessionLatency, SessionCount> sessionLatency;
+
+  // order book for market
+  std::vector<OperationHandle> marketOperations;
+  long sendsSinceBookRender = 0;
+  DepthBook marketDepth;
+
+  // outbound stream copied to the verifier, which checks the cross invariant on its own core
+  SpscRing<MarketMessage, 4096> outboundMessages;
+  long marketMessageSequence = 0;
+  std::thread verifier;
+  bool verifierRunning = false;
+  std::atomic<bool> verifierStopping {false};
+  std::atomic<long> verifierFailedAt {-1}; // sequence of the first message that crossed the book
+  std::atomic<int> verifierFailedPrice {0};
+};
@@ -1,849 +1,257 @@
-#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
 #include <iostream>
-#include <sstream>
-#include <iomanip>
-#include <map>
-#include <vector>
+#include <iterator>
 #include <random>
-#include <cassert>
-#include <memory>
-
-const int MaxOperationsToClearFromQueue = 10;
-const int MaxOperationsToGenerateAtATime = 10;
-const double LikelyhoodOfBeingThrottled = 0.15;
-const int MaxOperationsToAcknowledge = 10;
-const int UpperPrice = 9;
-const int UpperVolume = 100;
-
-enum class Action
-{
-  INSERT_ORDER,
-  QUOTE_ONCE,
-  QUOTE_TWICE,
-  QUOTE_THREE_TIMES,
-  QUOTE_FOUR_TIMES,
-  QUOTE_FIVE_TIMES,
-  QUOTE_SIX_TIMES,
-  AMEND_ONCE,
-  AMEND_TWICE,
-  AMEND_THREE_TIMES,
-  DELETE_ORDER,
-  DELETE_QUOTE
-};
-
-enum class OrderState
-{
-  PriorToMarket,
-  OnMarket, // sent to market, possibly not yet acknowledged
-  DeleteSentToMarket,
-  Finalised // gone
-};
-
-enum class OperationType
-{
-  InsertOrder,
-  InsertQuote,
-  AmendOrder,
-  DeleteOrder,
-  DeleteQuote
-};
-
-enum class OperationState
-{
-  Initial,
-  Queued,
-  SentToMarket,
-  Acked
-};
-
-struct Order;
-
-struct Operation
-{
-  Operation(Order& _order)
-    : order(_order)
-  {
-  }
-
-  Order& order;
-  Operation* previousOperation = nullptr;
-  OperationType operationType;
-  OperationState operationState;
-  int price;
-  int qty;
-  int bidPrice;
-  int bidQty;
-  int askPrice;
-  int askQty;
-};
-
-enum class Side
-{
-  Buy,
-  Sell
-};
-
-struct Order
-{
-  int price;
-  int qty;
-  Side side;
-  OrderState orderState;
-  std::vector<std::unique_ptr<Operation>> operations;
-  bool isQuote = false;
-};
-
-std::ostream& operator<<(std::ostream& stream, const Operation& operation)
-{
-  static std::map<OperationType, std::string> typeMap {
-    {OperationType::InsertOrder, "InsertOrder"},
-    {OperationType::InsertQuote, "InsertQuote"},
-    {OperationType::AmendOrder, "AmendOrder"},
-    {OperationType::DeleteOrder, "DeleteOrder"},
-    {OperationType::DeleteQuote, "DeleteQuote"}
-  };
-  static std::map<OperationState, std::string> stateMap {
-    {OperationState::Initial, "Initial"},
-    {OperationState::SentToMarket, "SentToMarket"},
-    {OperationState::Queued, "Queued"},
-    {OperationState::Acked, "Acked"}
-  };
+#include <string_view>
+#include <vector>
 
-  stream << "Type: " << typeMap[operation.operationType] << ", state: " << stateMap[operation.operationState] << ", ";
-  if (operation.order.isQuote)
-  {
-    stream << operation.bidQty << "@" << operation.bidPrice << "--" << operation.askQty << "@" << operation.askPrice;
-  }
-  else
-  {
-    stream << operation.qty << "@" << operation.price;
-  }
-  return stream;
-}
+#include "exchange_simulator.h"
+#include "order_manager.h"
+#include "strategies.h"
 
-std::ostream& operator<<(std::ostream& stream, const Order& order)
+void CheckInvariants(OrderManager& manager, long iteration, const char* step)
 {
-  static std::map<OrderState, std::string> stateMap {
-    {OrderState::PriorToMarket, "PriorToMarket"},
-    {OrderState::OnMarket, "OnMarket"},
-    {OrderState::DeleteSentToMarket, "DeleteSentToMarket"},
-    {OrderState::Finalised, "Finalised"}
-  };
-
-  stream << "State: " << stateMap[order.orderState] << ", Side: " << (order.side == Side::Buy ? "Buy" : "Sell")
-         << ", " << order.qty << "@" << order.price << ", operations: ";
-  for (auto& operation : order.operations)
-    stream << "[ " << *operation.get() << " ]";
-  return stream;
+  const char* broken = manager.FindBrokenInvariant();
+  if (!broken)
+    return;
+  std::cerr << "Invariant broken after " << step << " in iteration " << iteration << ": " << broken << std::endl;
+  exit(-1);
 }
 
-struct Quote
+// Runs the order manager off the exchange's event queue until the virtual clock passes `until` (0 runs
+// forever). Returns the number of events handled.
+long RunVirtualTime(OrderManager& manager, ExchangeSimulator& exchange, DecisionSource& random_engine, VirtualTime until, bool checkInvariants)
 {
-  int buyPrice;
-  int buyQty;
-  int sellPrice;
-  int sellQty;
-  std::vector<Operation> operations;
-};
-
-std::vector<std::unique_ptr<Order>> orders;
-std::vector<Operation*> throttle; // just references to managed objects
-// global quote object for order manager (not market book)
-Order* quotes;
-
-std::random_device random_device;
-std::default_random_engine random_engine(random_device());
-
-template <typename C>
-int GetLivePrice(C comparitor, Order& order)
-{
-  int inflightPrice = order.price;
-  int lastAckedPrice = order.price;
-  for (auto& operation : order.operations)
+  exchange.virtualTime = true;
+  std::exponential_distribution<> actionInterval(1.0 / MeanActionInterval);
+  exchange.ScheduleEvent(0, EventType::StrategyAction);
+  exchange.ScheduleEvent(ThrottleWindowLength, EventType::WindowReopen);
+  long handled = 0;
+  while (exchange.EventDue(until))
   {
-    if (operation->operationType == OperationType::AmendOrder || operation->operationType == OperationType::InsertOrder)
+    Event event = exchange.NextEvent();
+    switch (event.type)
     {
-      if (operation->operationState == OperationState::Acked)
-      {
-        // the very latest ack price should be taken into account
-        lastAckedPrice = operation->price;
-      }
-      else
-      {
-        // take any pending price into account
-        inflightPrice = comparitor(operation->price, inflightPrice);
-      }
+      case EventType::StrategyAction:
+        manager.GenerateOrderOperations();
+        if (checkInvariants)
+          CheckInvariants(manager, handled, "order operations");
+        exchange.ScheduleEvent(exchange.Now() + 1 + VirtualTime(actionInterval(random_engine)), EventType::StrategyAction);
+        break;
+      case EventType::WindowReopen:
+        manager.ProcessThrottleQueue();
+        if (checkInvariants)
+          CheckInvariants(manager, handled, "throttle drain");
+        manager.ReclaimMemory(1000, 200, 150);
+        exchange.ScheduleEvent(exchange.Now() + ThrottleWindowLength, EventType::WindowReopen);
+        break;
+      case EventType::AckArrival:
+        manager.AckOperation(event.operation);
+        if (checkInvariants)
+          CheckInvariants(manager, handled, "acks");
+        break;
     }
+    manager.RunStrategies();
+    if (checkInvariants)
+      CheckInvariants(manager, handled, "strategies");
+    exchange.CheckVerifier();
+    ++handled;
   }
-  return comparitor(inflightPrice, lastAckedPrice);
+  return handled;
 }
 
-bool CheckPendingInsertOrAmend(Order& pendingOrder)
-{
-  // check quotes first
-  if (pendingOrder.side == Side::Buy)
-  {
-    int lastAckedPrice = std::numeric_limits<int>::max();
-    int lowestUnackedPrice = std::numeric_limits<int>::max();
-    for (auto& quoteOperation : quotes->operations)
-    {
-      if (quoteOperation->askQty == -1)
-        continue; // no active quote
-      if (quoteOperation->operationState == OperationState::Acked)
-      {
-        lastAckedPrice = quoteOperation->askPrice;
-      }
-      else
-      {
-        lowestUnackedPrice = std::min(lowestUnackedPrice, quoteOperation->askPrice);
-      }
-    }
-    int lowestPrice = std::min(lastAckedPrice, lowestUnackedPrice);
-    if (pendingOrder.price >= lowestPrice)
-    {
-      std::cout << "* Buy order crosses with existing quote at price level " << lowestPrice << std::endl;
-      return false; // will cross with quote
-    }
-  }
-  else // ask
-  {
-    int lastAckedPrice = std::numeric_limits<int>::min();
-    int highestUnackedPrice = std::numeric_limits<int>::min();
-    for (auto& quoteOperation : quotes->operations)
-    {
-      if (quoteOperation->bidQty == -1)
-        continue;
-      if (quoteOperation->operationState == OperationState::Acked)
-      {
-        lastAckedPrice = quoteOperation->bidPrice;
-      }
-      else
-      {
-        highestUnackedPrice = std::max(highestUnackedPrice, quoteOperation->bidPrice);
-      }
-    }
-    int highestPrice = std::max(lastAckedPrice, highestUnackedPrice);
-    if (pendingOrder.price <= highestPrice)
-    {
-      std::cout << "* Sell order crosses with existing quote at price level " << highestPrice << std::endl;
-      return false; // will cross with quote
-    }
-  }
-
-  // walk through all opposing orders and check that not in cross
-  for (auto& order: orders)
-  {
-    if (order->side == pendingOrder.side)
-      continue; // same order
-    if (order->orderState == OrderState::Finalised)
-      continue; // can't be in cross if other order is gone
-    if (order->orderState == OrderState::DeleteSentToMarket)
-      continue; // can't be in cross if other order is going
-
-    if (pendingOrder.side == Side::Buy) // order must be opposing side if we are here
-    {
-      int pendingBuy = GetLivePrice([](int a, int b) { return std::max(a, b); }, pendingOrder);
-      int minSubmittedSell = GetLivePrice([](int a, int b){return std::min(a, b);}, *order.get());
-      if (pendingBuy < minSubmittedSell)
-        continue;
-      else
-        std::cout << "* Buy order crosses with existing order" << std::endl;
-    }
-    else // order must be opposing side if we are here
+// The fuzz target's steps over a stream of decisions: each byte chooses the next action, price, throttle
+// decision or ack count. Memory is reclaimed with small limits so that the erase paths are reached by
+// short streams. Aborts on the first broken invariant, saying how far into the stream it got. Returns
+// the number of steps run.
+long ReplayDecisions(const uint8_t* decisions, size_t size)
+{
+  DecisionSource random_engine(0);
+  random_engine.Replay(decisions, size);
+  ExchangeSimulator exchange(random_engine);
+  exchange.bookRenderInterval = 0;
+  OrderManager manager(exchange, random_engine);
+  manager.Spawn(WorkOrders(manager, 1, random_engine));
+
+  long steps = 0;
+  while (!random_engine.Exhausted())
+  {
+    manager.GenerateOrderOperations();
+    manager.ProcessThrottleQueue();
+    manager.AckOrderOperations();
+    manager.RunStrategies();
+    manager.ReclaimMemory(16, 12, 8);
+    ++steps;
+    if (const char* broken = manager.FindBrokenInvariant())
     {
-      int pendingSell = GetLivePrice([](int a, int b) { return std::min(a, b); }, pendingOrder);
-      int maxSubmittedBuy = GetLivePrice([](int a, int b){return std::max(a, b);}, *order.get());
-      if (pendingSell > maxSubmittedBuy)
-        continue;
-      else
-        std::cout << "* Sell order crosses with existing order" << std::endl;
+      std::cerr << "Invariant broken: " << broken << std::endl;
+      std::cerr << "In step " << steps << ", at decision " << random_engine.Position() << " of " << size << std::endl;
+      abort();
     }
-    return false;
   }
-  return true;
-}
-
-bool CheckThrottle()
-{
-  if (!throttle.empty())
-    return false; // must throttle
-  std::bernoulli_distribution distribution(1 - LikelyhoodOfBeingThrottled); // from time to time simulate window becoming closed
-  return distribution(random_engine);
-}
-
-void RemoveFromThrottle(Order* order)
-{
-  throttle.erase(std::remove_if(throttle.begin(), throttle.end(), [order](const Operation* operation)
-  {
-    if (&operation->order == order)
-    {
-      std::cout << "Removing operation from throttle: " << *operation << std::endl;
-      return true;
-    }
-    return false;
-  }), throttle.end());
+  return steps;
 }
 
-void RemoveDiscardedOperations(Operation& operation)
-{
-  auto& operations = operation.order.operations;
-  Operation* thisOperation = &operation;
-  bool flag = true;
-  operations.erase(std::remove_if(operations.begin(), operations.end(), [thisOperation, &flag](const std::unique_ptr<Operation>& ptr)
-  {
-    if (ptr.get() != thisOperation)
-    {
-      if (ptr->operationState == OperationState::Queued)
-      {
-          if (flag)
-            thisOperation->previousOperation = ptr->previousOperation;
-          flag = false;
-          std::cout << "Removing operation from order: " << *ptr << std::endl;
-          return true;
-      }
-    }
-    return false;
-  }), operations.end());
-}
+#ifdef THROTTLING_FUZZ
 
-void PushToThrottle(Operation& operation)
+// libFuzzer entry point, so a crash it finds replays with throttling --replay
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size)
 {
-  // ovewrite anything else in queue (i.e. remove everything else from queue)
-  RemoveFromThrottle(&operation.order);
-  throttle.push_back(&operation);
-  operation.operationState = OperationState::Queued;
-  std::cout << "Operation throttled: " << operation << ", queue size now: " << throttle.size() << std::endl;
-
-  // remove discarded throttled operations from order
-  RemoveDiscardedOperations(operation);
+  std::cout.setstate(std::ios_base::badbit);
+  ReplayDecisions(data, size);
+  return 0;
 }
 
-// order book for market
-std::vector<Operation*> marketOperations;
-
-void PrintOrderBook()
-{
-  std::map<int, int> bids;
-  std::map<int, int> asks;
-  for (Operation* operation : marketOperations)
-  {
-    if (operation->order.isQuote)
+#else
+
+int main(int argc, char* argv[])
+{
+  // throttling [--quiet] [--check] [--virtual] [--window-units n] [--cancel-reserve n] [--throttled p]
+  //            [--ack-latency model] [--ack-spikes spikes] [--work-orders n] [--verifier-core n]
+  //            [iterations [seed [render interval]]]
+  // a bounded run is needed for PGO training, benchmarking and stress testing
+  // throttling [--quiet] --replay file
+  // throttling --write-decisions file decisions [seed]
+  bool checkInvariants = false;
+  bool runVirtualTime = false;
+  int workOrderStrategies = 0;
+  int verifierCore = -1;
+  const char* replayFile = nullptr;
+  const char* decisionsFile = nullptr;
+  ThrottlePolicy policy;
+  AckLatencyProfile ackLatency;
+  std::vector<const char*> arguments;
+  for (int i = 1; i < argc; ++i)
+  {
+    std::string_view argument(argv[i]);
+    if (argument == "--quiet")
+      std::cout.setstate(std::ios_base::badbit); // formatting is skipped entirely
+    else if (argument == "--check")
+      checkInvariants = true;
+    else if (argument == "--virtual")
+      runVirtualTime = true; // iterations are then seconds of virtual time
+    else if (argument == "--window-units" && i + 1 < argc)
+      policy.maxThrottleUnitsPerWindow = std::atoi(argv[++i]);
+    else if (argument == "--cancel-reserve" && i + 1 < argc)
+      policy.cancelReserveUnits = std::atoi(argv[++i]);
+    else if (argument == "--throttled" && i + 1 < argc)
+      policy.likelihoodOfBeingThrottled = std::atof(argv[++i]);
+    else if (argument == "--work-orders" && i + 1 < argc)
+      workOrderStrategies = std::atoi(argv[++i]); // coroutine strategies alongside the generated workload
+    else if (argument == "--verifier-core" && i + 1 < argc)
+      verifierCore = std::atoi(argv[++i]);
+    else if (argument == "--replay" && i + 1 < argc)
+      replayFile = argv[++i]; // a decision stream, run as the fuzz target runs it
+    else if (argument == "--write-decisions" && i + 1 < argc)
+      decisionsFile = argv[++i]; // iterations random decisions from the seed, for --replay
+    else if ((argument == "--ack-latency" || argument == "--ack-spikes") && i + 1 < argc)
     {
-      if (operation->bidQty > -1)
-        bids[operation->bidPrice] += operation->bidQty;
-      if (operation->askQty > -1)
-        asks[operation->askPrice] += operation->askQty;
-    }
-    else
-    {
-      if (operation->order.side == Side::Buy)
-      {
-        bids[operation->price] += operation->qty;
-      }
-      else
+      // only used by virtual time runs
+      if (!(argument == "--ack-latency" ? ParseAckLatency(argv[i + 1], ackLatency) : ParseAckSpikes(argv[i + 1], ackLatency)))
       {
-        asks[operation->price] += operation->qty;
+        std::cerr << "Bad " << argument << ": " << argv[i + 1] << std::endl;
+        return 1;
       }
+      ++i;
     }
-  }
-  //std::cout << "\033[2J\033[1;1H"; // clear screen
-  bool failed = false;
-  for (int price = UpperPrice; price > 0; --price)
-  {
-    std::stringstream bidPrice;
-    if (bids[price])
-      bidPrice << std::right << std::setfill(' ') << std::setw(5) << bids[price];
-    else
-      bidPrice << std::right << std::setfill(' ') << std::setw(5) << ' ';
-    std::cout << bidPrice.str() << " " << price << " ";
-    std::stringstream askPrice;
-    if (asks[price])
-      askPrice << std::left << std::setfill(' ') << std::setw(5) << asks[price];
     else
-      askPrice << std::left << std::setfill(' ') << std::setw(5) << ' ';
-    std::cout << askPrice.str() << std::endl;
-    if (bids[price] && asks[price])
-    {
-      std::cout << "********* IN CROSS ************" << std::endl;
-      failed = true;
-    }
-  }
-  if (failed)
-    exit(-1);
-}
-
-void SendToMarket(Operation& operation)
-{
-  operation.operationState = OperationState::SentToMarket;
-  std::cout << "Operation sent to market, " << operation << std::endl;
-
-  // update order manager
-  if (operation.operationType == OperationType::DeleteOrder || operation.operationType == OperationType::DeleteQuote)
-    operation.order.orderState = OrderState::DeleteSentToMarket;
-  else
-    operation.order.orderState = OrderState::OnMarket;
-
-  // the previous operation overwrites the last
-  Operation* previousOperation = operation.previousOperation;
-  if (previousOperation)
-  {
-      auto it = std::find(marketOperations.begin(), marketOperations.end(), previousOperation);
-      if (it == marketOperations.end())
-      {
-        std::cout << "Can't find existing operation in market book: " << *previousOperation << std::endl;
-        throw;
-      }
-      marketOperations.erase(it);
-  }
-  // add inserts and amends (a delete will have already cleared last item)
-  if (operation.operationType == OperationType::InsertOrder || operation.operationType == OperationType::AmendOrder || operation.operationType == OperationType::InsertQuote)
-  {
-    marketOperations.push_back(&operation); // includes quotes
-  }
-  PrintOrderBook();
-}
-
-int RandomPrice(int lower, int upper)
-{
-  std::uniform_int_distribution<> distribution(lower, upper);
-  return distribution(random_engine);
-}
-
-int RandomPrice()
-{
-  return RandomPrice(1, UpperPrice);
-}
-
-int RandomQty()
-{
-  std::uniform_int_distribution<> distribution(1, UpperVolume);
-  return distribution(random_engine);
-}
-
-Side RandomSide()
-{
-  std::uniform_int_distribution<> distribution((int)Side::Buy, (int)Side::Sell);
-  return (Side)distribution(random_engine);
-}
-
-void InsertOrder()
-{
-  orders.push_back(std::move(std::unique_ptr<Order>(new Order())));
-  Order* order = orders.back().get();
-  order->price = RandomPrice();
-  order->qty = RandomQty();
-  order->side = RandomSide();
-  order->orderState = OrderState::PriorToMarket;
-
-  order->operations.push_back(std::unique_ptr<Operation>(new Operation(*order)));
-  Operation* operation = order->operations.back().get();
-  operation->operationType = OperationType::InsertOrder;
-  operation->operationState = OperationState::Initial;
-  operation->price = order->price;
-  operation->qty = order->qty;
-
-  std::cout << "Order insert: " << *order << std::endl;
-
-  if (!CheckPendingInsertOrAmend(*order))
-  {
-    std::cout << "*** Order insert crossed, rejecting operation: " << *operation << std::endl;
-    orders.pop_back();
-  }
-  else if (!CheckThrottle())
-  {
-     std::cout << "Throttle closed" << std::endl;
-     PushToThrottle(*operation);
-  }
-  else
-  {
-    SendToMarket(*operation);
-  }
-}
-
-Order* GetRandomLiveOrder()
-{
-  std::uniform_int_distribution<> uniform_dist(0, orders.size());
-  const int maxAttempts = orders.size();
-  int i = 0;
-  while (i++ < maxAttempts)
-  {
-    int orderIndex = uniform_dist(random_engine);
-    auto it = orders.begin() + orderIndex;
-    if (it != orders.end())
-    {
-        Order* order = it->get();
-        if (order->orderState == OrderState::OnMarket || order->orderState == OrderState::PriorToMarket)
-        {
-          if (!order->isQuote)
-            return order;
-        }
-    }
-  }
-  return nullptr;
-}
-
-void DeleteOrder(Order* order)
-{
-  // mark as deleted (so we don't consider for cross, but still send and wait for ack before removing
-  Operation* previousOperation = order->operations.back().get();
-  order->operations.push_back(std::unique_ptr<Operation>(new Operation(*order)));
-  Operation* operation = order->operations.back().get();
-  operation->previousOperation = previousOperation;
-  operation->operationType = OperationType::DeleteOrder;
-  operation->operationState = OperationState::Initial;
-  operation->price = order->price;
-  operation->qty = order->qty;
-  std::cout << "Order delete, [" << *order << "] , previous operation: " << *previousOperation << std::endl;
-
-  // if order is not live (i.e. queued), can remove right now
-  if (order->orderState == OrderState::PriorToMarket)
-  {
-      RemoveFromThrottle(order);
-      order->orderState = OrderState::Finalised;
-      auto it = std::find_if(orders.begin(), orders.end(), [order](const std::unique_ptr<Order>& ptr) { return ptr.get() == order; });
-      orders.erase(it);
-      return;
-  }
-
-  // remove any queued items
-  RemoveFromThrottle(order);
-  // remove discarded throttled operations from order
-  RemoveDiscardedOperations(*operation);
-
-  order->orderState = OrderState::DeleteSentToMarket;
-
-  if (!CheckThrottle())
-  {
-     std::cout << "Throttle closed" << std::endl;
-     PushToThrottle(*operation);
-  }
-  else
-  {
-    SendToMarket(*operation);
-  }
-}
-
-void AmendOrder()
-{
-  // update price/qty of order immediately
-  Order* order = GetRandomLiveOrder();
-  if (!order)
-    return;
-  order->price = RandomPrice();
-  order->qty = RandomQty();
-  Operation* previousOperation = order->operations.back().get();
-  order->operations.push_back(std::unique_ptr<Operation>(new Operation(*order)));
-  Operation* operation = order->operations.back().get();
-  operation->previousOperation = previousOperation;
-  operation->operationType = OperationType::AmendOrder;
-  operation->operationState = OperationState::Initial;
-  operation->price = order->price;
-  operation->qty = order->qty;
-  std::cout << "Order amend to " << order->qty << "@" << order->price << " [" << *order << "], previous operation: " << *previousOperation << std::endl;
-
-  if (!CheckPendingInsertOrAmend(*order))
-  {
-    std::cout << "*** Order amend crossed, rejecting operation: " << *operation << std::endl;
-    order->operations.pop_back();
-    // clear up order (on market and/or in queue)
-    DeleteOrder(order);
-  }
-  else if (!CheckThrottle())
-  {
-     std::cout << "Throttle closed" << std::endl;
-     PushToThrottle(*operation);
-  }
-  else
-  {
-    assert(previousOperation->operationState != OperationState::Queued);
-    SendToMarket(*operation);
-  }
-}
-
-void DeleteQuote()
-{
-  if (quotes->orderState == OrderState::DeleteSentToMarket || quotes->orderState == OrderState::Finalised)
-    return; // nothing to delete
-  Operation* previousOperation = quotes->operations.back().get();
-  quotes->operations.push_back(std::unique_ptr<Operation>(new Operation(*quotes)));
-  Operation* deleteQuoteOperation = quotes->operations.back().get();
-  deleteQuoteOperation->previousOperation = previousOperation;
-  deleteQuoteOperation->operationType = OperationType::DeleteQuote;
-  deleteQuoteOperation->operationState = OperationState::Initial;
-  deleteQuoteOperation->askPrice = 0;
-  deleteQuoteOperation->askQty = -1;
-  deleteQuoteOperation->bidPrice = 0;
-  deleteQuoteOperation->bidQty = -1;
-  std::cout << "Quote delete, [" << *deleteQuoteOperation << "] , previous operation: " << *previousOperation << std::endl;
-
-  // if quote is not live (i.e. queued), we can remove right now
-  if (quotes->orderState == OrderState::PriorToMarket)
-  {
-      RemoveFromThrottle(quotes);
-      quotes->orderState = OrderState::Finalised;
-      return;
-  }
-
-  // remove any queued items
-  RemoveFromThrottle(quotes);
-  // remove discarded throttled operations from quote
-  RemoveDiscardedOperations(*deleteQuoteOperation);
-
-  quotes->orderState = OrderState::DeleteSentToMarket;
-
-  if (!CheckThrottle())
-  {
-     std::cout << "Throttle closed for quote delete" << std::endl;
-     PushToThrottle(*deleteQuoteOperation);
-  }
-  else
-  {
-    SendToMarket(*deleteQuoteOperation);
-  }
-}
-
-bool CheckPendingQuote(Operation* quoteOperation)
-{
-  // we assume that quotes won't cross with each other
-  // walk through all orders and check that not in cross
-  for (auto& order: orders)
-  {
-    if (order->isQuote)
-      continue; // special quote entry
-    if (order->orderState == OrderState::Finalised)
-      continue; // can't be in cross if other order is gone
-    if (order->orderState == OrderState::DeleteSentToMarket)
-      continue; // can't be in cross if other order is going
-
-    if (order->side == Side::Buy)
-    {
-      if (quoteOperation->askQty > -1)
-      {
-        int maxSubmittedBuy = GetLivePrice([](int a, int b){return std::max(a, b);}, *order.get());
-        if (quoteOperation->askPrice > maxSubmittedBuy)
-          continue;
-        else
-          std::cout << "* Quote ask crosses with existing order" << std::endl;
-      }
-    }
-    else // sell order
-    {
-      if (quoteOperation->bidQty > -1)
-      {
-        int minSubmittedSell = GetLivePrice([](int a, int b){return std::min(a, b);}, *order.get());
-        if (quoteOperation->bidPrice < minSubmittedSell)
-          continue;
-        else
-          std::cout << "* Quote bid crosses with existing order" << std::endl;
-      }
-    }
-    return false; // the quote crossed with an order
-  }
-  return true;
-}
-
-void InitQuotes()
-{
-  orders.push_back(std::move(std::unique_ptr<Order>(new Order())));
-  Order* order = orders.back().get();
-  quotes = order;
-  order->isQuote = true;
-  order->price = 0;
-  order->qty = -1;
-  order->side = RandomSide(); // not important here
-  order->orderState = OrderState::PriorToMarket;
-}
-
-void Quote()
-{
-  // A quote as just another order that stays alive and is two sided. So we need
-  // to check all outstanding quote operations prior to insert (due to throttling)
-
-  // if this is an insert, link it to the previous (this helps out the market order book)
-  Operation* previousOperation = nullptr;
-  if (!quotes->operations.empty() && quotes->operations.back()->operationType == OperationType::InsertQuote)
-  {
-     previousOperation = quotes->operations.back().get();
-  }
-  quotes->operations.push_back(std::unique_ptr<Operation>(new Operation(*quotes)));
-  Operation* operation = quotes->operations.back().get();
-  operation->operationState = OperationState::Initial;
-  operation->operationType = OperationType::InsertQuote;
-  operation->previousOperation = previousOperation;
-  operation->bidPrice = RandomPrice(1, UpperPrice - 1);
-  operation->bidQty = RandomQty();
-  operation->askPrice = RandomPrice(operation->bidPrice + 1, UpperPrice);
-  operation->askQty = RandomQty();
-
-  std::cout << "Quote insert: " << *operation << std::endl;
-
-  // check that quote isn't in cross. If it is, delete previous quote
-  if (!CheckPendingQuote(operation))
-  {
-    std::cout << "*** Quote insert crossed, rejecting operation: " << *operation << std::endl;
-    quotes->operations.pop_back();
-    return;
-  }
-
-  if (!CheckThrottle())
-  {
-     std::cout << "Throttle closed" << std::endl;
-    // add to throttle and conflate any other quote operations (including deletes)
-    PushToThrottle(*operation);
-    return;
-  }
-  SendToMarket(*operation);
-}
-
-void PerformAction(Action action)
-{
-  switch (action)
-  {
-    case Action::INSERT_ORDER:
-      InsertOrder();
-      break;
-    case Action::DELETE_ORDER:
-      {
-      Order* order = GetRandomLiveOrder();
-        if (order)
-          DeleteOrder(order);
-      }
-      break;
-    case Action::AMEND_ONCE:
-    case Action::AMEND_TWICE:
-    case Action::AMEND_THREE_TIMES:
-      AmendOrder();
-      break;
-    case Action::QUOTE_ONCE:
-    case Action::QUOTE_TWICE:
-    case Action::QUOTE_THREE_TIMES:
-    case Action::QUOTE_FOUR_TIMES:
-    case Action::QUOTE_FIVE_TIMES:
-    case Action::QUOTE_SIX_TIMES:
-      Quote();
-      break;
-    case Action::DELETE_QUOTE:
-      DeleteQuote();
-      break;
+      arguments.push_back(argv[i]);
   }
-}
-
-void GenerateOrderOperations()
-{
-  std::uniform_int_distribution<> numOpsGenerator(1, MaxOperationsToGenerateAtATime);
-  int numOperations = numOpsGenerator(random_engine);
+  long iterations = arguments.size() > 0 ? std::atol(arguments[0]) : 0;
+  DecisionSource random_engine(arguments.size() > 1 ? std::strtoul(arguments[1], nullptr, 10) : std::random_device()());
 
-  std::uniform_int_distribution<> uniform_dist((int)Action::INSERT_ORDER, (int)Action::DELETE_QUOTE);
-  for (int i = 0; i < numOperations; ++i)
+  if (decisionsFile)
   {
-    Action action = (Action)uniform_dist(random_engine);
-    PerformAction(action);
+    std::ofstream file(decisionsFile, std::ios::binary);
+    std::uniform_int_distribution<> decision(0, UINT8_MAX);
+    for (long i = 0; i < iterations; ++i)
+      file.put(char(decision(random_engine)));
+    return file ? 0 : 1;
   }
-}
-
-void AckOrderOperations()
-{
-  // TODO randomise a little
-  std::uniform_int_distribution<> distribution(0, MaxOperationsToAcknowledge);
-  int numItemsToAck = distribution(random_engine);
-  int itemsAcked = 0;
-  for (auto& order : orders)
+  if (replayFile)
   {
-    if (order->orderState == OrderState::Finalised)
-      continue;
-    for (auto& operation : order->operations)
+    std::ifstream file(replayFile, std::ios::binary);
+    if (!file)
     {
-      if (itemsAcked == numItemsToAck)
-        break;
-      if (operation->operationState == OperationState::SentToMarket)
-      {
-        std::cout << "Acked operation " << *operation.get() << std::endl;
-        operation->operationState = OperationState::Acked;
-        if (operation->operationType == OperationType::DeleteOrder)
-        {
-          order->orderState = OrderState::Finalised;
-        }
-        else
-        {
-          // only mark as on market if we haven't already marked this as deleting
-          if (order->orderState != OrderState::DeleteSentToMarket)
-            order->orderState = OrderState::OnMarket;
-        }
-
-        ++itemsAcked;
-      }
-    }
-  }
-}
-
-void ProcessThrottleQueue()
-{
-  if (throttle.empty())
-    return;
-
-  std::cout << "Throttle queue contains: ";
-  for (auto& operation : throttle)
-    std::cout << *operation;
-  std::cout << std::endl;
-
-  std::uniform_int_distribution<> distribution(0, MaxOperationsToClearFromQueue);
-  int window = distribution(random_engine);
-  // deletes first
-  std::vector<Operation*>::reverse_iterator it = throttle.rbegin();
-  while (window > 0 && it != throttle.rend())
-  {
-    Operation& operation = **it;
-    ++it;
-    if (operation.operationType == OperationType::DeleteOrder || operation.operationType == OperationType::DeleteQuote)
-    {
-      std::cout << "Operation popped from throttle, " << operation << std::endl;
-      SendToMarket(operation);
-      it = std::vector<Operation*>::reverse_iterator(throttle.erase(it.base()));
-      --window;
-      continue;
-    }
-  }
-  // all other operations
-  it = throttle.rbegin();
-  while (window > 0 && it != throttle.rend())
-  {
-    Operation& operation = **it;
-    ++it;
-    if (operation.operationType != OperationType::DeleteOrder && operation.operationType != OperationType::DeleteQuote)
-    {
-      std::cout << "Operation popped from throttle, " << operation << std::endl;
-      SendToMarket(operation);
-      it = std::vector<Operation*>::reverse_iterator(throttle.erase(it.base()));
-      --window;
-    }
-  }
-}
-
-int main()
-{
-  InitQuotes();
-  while (true)
-  {
-    GenerateOrderOperations();
-    ProcessThrottleQueue();
-    AckOrderOperations();
-
-    // only clear memory once and a while
-    if (orders.size() > 1000)
-    {
-      orders.erase(std::remove_if(orders.begin(), orders.end(), [](const std::unique_ptr<Order>& ptr) { return ptr->orderState == OrderState::Finalised; }), orders.end());
-      std::cout << "CLEARING ORDERS" << std::endl;
-    }
-
-    // just remove most of the acked quotes, if any of the remainder are already acked
-    if (quotes->operations.size() > 200)
-    {
-      if (quotes->operations[150]->operationState == OperationState::Acked)
-      {
-        quotes->operations.erase(quotes->operations.begin(), quotes->operations.begin() + 150);
-        std::cout << "CLEARING QUOTES" << std::endl;
-      }
+      std::cerr << "Can't read " << replayFile << std::endl;
+      return 1;
     }
+    std::vector<uint8_t> decisions((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+    auto start = std::chrono::steady_clock::now();
+    long steps = ReplayDecisions(decisions.data(), decisions.size());
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    std::cerr << "Replayed " << decisions.size() << " decisions in " << steps << " steps, " << long(steps / elapsed.count()) << " steps/s" << std::endl;
+    return 0;
+  }
+
+  ExchangeSimulator exchange(random_engine);
+  exchange.ackLatency = ackLatency;
+  if (arguments.size() > 2)
+    exchange.bookRenderInterval = std::atoi(arguments[2]);
+  if (!exchange.StartVerifier(verifierCore))
+  {
+    std::cerr << "Bad --verifier-core: " << verifierCore << std::endl;
+    return 1;
+  }
+  OrderManager manager(exchange, random_engine, policy);
+  for (int i = 0; i < workOrderStrategies; ++i)
+    manager.Spawn(WorkOrders(manager, 1 + i % (Strategies.size() - 1), random_engine)); // shared out like generated orders
+  if (runVirtualTime)
+  {
+    long handled = RunVirtualTime(manager, exchange, random_engine, iterations * 1'000'000'000, checkInvariants);
+    std::cerr << "Virtual time: " << exchange.Now() / 1e9 << "s simulated, " << handled << " events, " << manager.GetThrottle().Window()
+              << " throttle windows, " << exchange.ackLatencySpikes << " ack latency spikes" << std::endl;
+  }
+  for (long iteration = 0; !runVirtualTime && (iterations == 0 || iteration < iterations); ++iteration)
+  {
+    manager.GenerateOrderOperations();
+    if (checkInvariants)
+      CheckInvariants(manager, iteration, "order operations");
+    manager.ProcessThrottleQueue();
+    if (checkInvariants)
+      CheckInvariants(manager, iteration, "throttle drain");
+    manager.AckOrderOperations();
+    if (checkInvariants)
+      CheckInvariants(manager, iteration, "acks");
+    manager.RunStrategies();
+    if (checkInvariants)
+      CheckInvariants(manager, iteration, "strategies");
+    exchange.CheckVerifier();
+    manager.ReclaimMemory(1000, 200, 150);
+  }
+
+  exchange.StopVerifier();
+  exchange.CheckVerifier();
+
+  // on stderr so that quiet benchmark runs still report it
+  const Throttle& throttle = manager.GetThrottle();
+  const AmendCheckCounts& amendChecks = manager.amendChecks;
+  long amends = amendChecks.qtyOnly + amendChecks.passiveReprice + amendChecks.aggressiveReprice;
+  std::cerr << "Amend cross checks: " << amendChecks.aggressiveReprice << " of " << amends << " performed, "
+            << amendChecks.qtyOnly << " skipped as qty only, " << amendChecks.passiveReprice << " skipped as passive reprice" << std::endl;
+  std::cerr << "Send latency in throttle windows: cancels p50 " << throttle.cancelLatency.Percentile(0.5) << " p99 " << throttle.cancelLatency.Percentile(0.99)
+            << " (" << throttle.cancelLatency.Total() << " sent, " << throttle.cancelsFromReserve << " from the reserve), others p50 "
+            << throttle.otherLatency.Percentile(0.5) << " p99 " << throttle.otherLatency.Percentile(0.99) << " (" << throttle.otherLatency.Total() << " sent)" << std::endl;
+  std::cerr << "Quotes not priced while the throttle was closed: " << manager.quotesNotPriced << ", quotes sent stale after one was: " << manager.staleQuotesSent << std::endl;
+  std::cerr << "At each send: in flight on the session p50 " << manager.inFlightAtSend.Percentile(0.5) << " p99 " << manager.inFlightAtSend.Percentile(0.99)
+            << ", unacked on the order p50 " << manager.unackedAtSend.Percentile(0.5) << " p99 " << manager.unackedAtSend.Percentile(0.99) << std::endl;
+  const ConflationCounts& conflations = manager.conflations;
+  std::cerr << "Conflated into a queued operation: " << conflations.amendsConflated << " of " << conflations.amends << " amends, "
+            << conflations.quotesConflated << " of " << conflations.quotes << " quotes" << std::endl;
+  for (size_t strategy = 0; strategy < throttle.strategyStats.size(); ++strategy)
+  {
+    const SendStats& stats = throttle.strategyStats[strategy];
+    std::cerr << "Strategy " << Strategies[strategy].name << " (weight " << Strategies[strategy].weight << "): " << stats.sent << " sent, "
+              << stats.unitsSent << " units, latency p50 " << stats.latency.Percentile(0.5) << " p99 " << stats.latency.Percentile(0.99) << std::endl;
+  }
+  for (size_t session = 0; session < throttle.Sessions().size(); ++session)
+  {
+    const SendStats& stats = throttle.Sessions()[session].stats;
+    std::cerr << "Session " << session << ": " << stats.sent << " sent, " << stats.unitsSent << " units, latency p50 "
+              << stats.latency.Percentile(0.5) << " p99 " << stats.latency.Percentile(0.99) << std::endl;
   }
 }
 
+#endif
@@ -0,0 +1,1190 @@
+// The order manager: orders, quotes and their operation histories, the cross checks run before
+// anything is sent, and the throttle sends wait in. Everything it owns lives in the instance, so any
+// number can run side by side, each with its own exchange and source of decisions.
+#pragma once
+
+#include <coroutine>
+#include <utility>
+
+#include "exchange_simulator.h"
+#include "order_types.h"
+#include "strategy_task.h"
+#include "throttle.h"
+
+class OrderManager
+{
+public:
+  OrderManager(ExchangeSimulator& exchange, DecisionSource& random_engine, const ThrottlePolicy& policy = ThrottlePolicy())
+    : exchange(exchange), random_engine(random_engine), throttle(policy, orderSlots, operationSlots, random_engine)
+  {
+    InitQuotes();
+  }
+
+  OrderManager(const OrderManager&) = delete;
+  OrderManager& operator=(const OrderManager&) = delete;
+
+  ~OrderManager()
+  {
+    for (std::coroutine_handle<> strategy : strategyTasks)
+      strategy.destroy();
+  }
+
+  const Throttle& GetThrottle() const
+  {
+    return throttle;
+  }
+
+  void InsertOrder()
+  {
+    std::vector<OperationHandle> batch { CreateInsertOrder() };
+    SubmitOrderOperations(batch);
+  }
+
+  void AmendOrder()
+  {
+    Order* order = GetRandomLiveOrder();
+    if (!order)
+      return;
+    std::vector<OperationHandle> batch { CreateAmendOrder(order) };
+    SubmitOrderOperations(batch);
+  }
+
+  OperationHandle DeleteOrder(Order* order)
+  {
+    // mark as deleted (so we don't consider for cross, but still send and wait for ack before removing
+    OperationHandle previousOperation = order->operations.back();
+    OperationHandle handle = NewOperation(*order);
+    Operation* operation = &operationSlots[handle];
+    operation->previousOperation = previousOperation;
+    operation->operationType = OperationType::DeleteOrder;
+    operation->operationState = OperationState::Initial;
+    operation->orderPayload.price = order->price;
+    operation->orderPayload.qty = order->qty;
+    std::cout << "Order delete, [" << Print(*order) << "] , previous operation: " << operationSlots[previousOperation] << std::endl;
+
+    // if order is not live (i.e. queued), can remove right now
+    if (order->Header().orderState == OrderState::PriorToMarket)
+    {
+        throttle.Remove(order);
+        order->Header().orderState = OrderState::Finalised;
+        RefreshExposure(*order);
+        EraseOrders([order](const OrderHeader& header) { return &header == &order->Header(); });
+        return handle;
+    }
+
+    // remove any queued items
+    throttle.Remove(order);
+    // remove discarded throttled operations from order
+    RemoveDiscardedOperations(*operation);
+
+    order->Header().orderState = OrderState::DeleteSentToMarket;
+    RefreshExposure(*order);
+
+    if (!throttle.Check(*operation))
+    {
+       std::cout << "Throttle closed" << std::endl;
+       throttle.Push(handle);
+    }
+    else
+    {
+      SendToMarket(handle);
+    }
+    return handle;
+  }
+
+  void Quote()
+  {
+    // A quote as just another order that stays alive and is two sided. So we need
+    // to check all outstanding quote operations prior to insert (due to throttling)
+
+    Order& quote = orderSlots[quotes];
+    // while the throttle is closed a new quote only replaces the queued one, so don't price it unless
+    // that is due out at the next drain
+    if (quoterSeesThrottleClosed && !quote.operations.empty() && operationSlots[quote.operations.back()].operationState == OperationState::Queued
+        && throttle.ExpectedWindowsToSend(quote.operations.back()) > 1)
+    {
+      ++quotesNotPriced;
+      quotePricingSkipped = true;
+      return;
+    }
+    quotePricingSkipped = false;
+
+    // checked before it is given a place in the quote's history, it may only update a queued operation
+    Operation candidate(quotes);
+    candidate.createdWindow = throttle.Window();
+    candidate.operationState = OperationState::Initial;
+    candidate.operationType = OperationType::InsertQuote;
+    candidate.quotePayload.bidPrice = RandomPrice(1, UpperPrice - 1);
+    candidate.quotePayload.bidQty = RandomQty();
+    candidate.quotePayload.askPrice = RandomPrice(candidate.quotePayload.bidPrice + 1, UpperPrice);
+    candidate.quotePayload.askQty = RandomQty();
+
+    std::cout << "Quote insert: " << candidate << std::endl;
+
+    // check that quote isn't in cross. If it is, delete previous quote
+    if (!CheckPendingQuote(&candidate))
+    {
+      std::cout << "*** Quote insert crossed, rejecting operation: " << candidate << std::endl;
+      return;
+    }
+
+    OperationHandle lastHandle = quote.operations.empty() ? OperationHandle() : quote.operations.back();
+    Operation* lastOperation = lastHandle ? &operationSlots[lastHandle] : nullptr;
+    ++conflations.quotes;
+    if (lastOperation && lastOperation->operationState == OperationState::Queued)
+    {
+      ++conflations.quotesConflated;
+      // conflate with the queued quote or quote delete, which keeps its place in the throttle and its
+      // link to the quote on the market
+      lastOperation->operationType = OperationType::InsertQuote;
+      lastOperation->quotePayload.bidPrice = candidate.quotePayload.bidPrice;
+      lastOperation->quotePayload.bidQty = candidate.quotePayload.bidQty;
+      lastOperation->quotePayload.askPrice = candidate.quotePayload.askPrice;
+      lastOperation->quotePayload.askQty = candidate.quotePayload.askQty;
+      std::cout << "Quote conflated into queued operation: " << *lastOperation << std::endl;
+      return;
+    }
+
+    OperationHandle handle = operationSlots.Insert(candidate);
+    quote.operations.push_back(handle);
+    // if this is an insert, link it to the previous (this helps out the market order book)
+    if (lastOperation && lastOperation->operationType == OperationType::InsertQuote)
+      operationSlots[handle].previousOperation = lastHandle;
+
+    if (!throttle.Check(operationSlots[handle]))
+    {
+       std::cout << "Throttle closed" << std::endl;
+      throttle.Push(handle);
+      return;
+    }
+    SendToMarket(handle);
+  }
+
+  void DeleteQuote()
+  {
+    Order* quote = &orderSlots[quotes];
+    if (quote->operations.empty() || quote->Header().orderState == OrderState::DeleteSentToMarket || quote->Header().orderState == OrderState::Finalised)
+      return; // nothing to delete
+
+    // if quote is not live (i.e. queued), we can remove right now: nothing in its history was sent. The
+    // quote lives as long as the order manager, so it goes back to waiting for its first send rather than
+    // being finalised
+    if (quote->Header().orderState == OrderState::PriorToMarket)
+    {
+        std::cout << "Quote delete, discarding unsent quote: " << operationSlots[quote->operations.back()] << std::endl;
+        throttle.Remove(quote);
+        for (OperationHandle handle : quote->operations)
+          EraseOperation(handle);
+        quote->operations.clear();
+        return;
+    }
+
+    OperationHandle previousOperation = quote->operations.back();
+    OperationHandle handle = NewOperation(*quote);
+    Operation* deleteQuoteOperation = &operationSlots[handle];
+    deleteQuoteOperation->previousOperation = previousOperation;
+    deleteQuoteOperation->operationType = OperationType::DeleteQuote;
+    deleteQuoteOperation->operationState = OperationState::Initial;
+    deleteQuoteOperation->quotePayload.askPrice = 0;
+    deleteQuoteOperation->quotePayload.askQty = -1;
+    deleteQuoteOperation->quotePayload.bidPrice = 0;
+    deleteQuoteOperation->quotePayload.bidQty = -1;
+    std::cout << "Quote delete, [" << *deleteQuoteOperation << "] , previous operation: " << operationSlots[previousOperation] << std::endl;
+
+    // remove any queued items
+    throttle.Remove(quote);
+    // remove discarded throttled operations from quote
+    RemoveDiscardedOperations(*deleteQuoteOperation);
+
+    quote->Header().orderState = OrderState::DeleteSentToMarket;
+
+    if (!throttle.Check(*deleteQuoteOperation))
+    {
+       std::cout << "Throttle closed for quote delete" << std::endl;
+       throttle.Push(handle);
+    }
+    else
+    {
+      SendToMarket(handle);
+    }
+  }
+
+  void PerformAction(Action action)
+  {
+    switch (action)
+    {
+      case Action::INSERT_ORDER:
+        InsertOrder();
+        break;
+      case Action::DELETE_ORDER:
+        {
+        Order* order = GetRandomLiveOrder();
+          if (order)
+            DeleteOrder(order);
+        }
+        break;
+      case Action::AMEND_ONCE:
+      case Action::AMEND_TWICE:
+      case Action::AMEND_THREE_TIMES:
+        AmendOrder();
+        break;
+      case Action::QUOTE_ONCE:
+      case Action::QUOTE_TWICE:
+      case Action::QUOTE_THREE_TIMES:
+      case Action::QUOTE_FOUR_TIMES:
+      case Action::QUOTE_FIVE_TIMES:
+      case Action::QUOTE_SIX_TIMES:
+        Quote();
+        break;
+      case Action::DELETE_QUOTE:
+        DeleteQuote();
+        break;
+    }
+  }
+
+  void GenerateOrderOperations()
+  {
+    std::uniform_int_distribution<> numOpsGenerator(1, MaxOperationsToGenerateAtATime);
+    int numOperations = numOpsGenerator(random_engine);
+
+    // consecutive inserts and amends are cross checked together, anything else flushes them first
+    std::vector<OperationHandle> batch;
+    std::uniform_int_distribution<> uniform_dist((int)Action::INSERT_ORDER, (int)Action::DELETE_QUOTE);
+    for (int i = 0; i < numOperations; ++i)
+    {
+      Action action = (Action)uniform_dist(random_engine);
+      switch (action)
+      {
+        case Action::INSERT_ORDER:
+          batch.push_back(CreateInsertOrder());
+          break;
+        case Action::AMEND_ONCE:
+        case Action::AMEND_TWICE:
+        case Action::AMEND_THREE_TIMES:
+          {
+            Order* order = GetRandomLiveOrder();
+            if (order && IsInBatch(batch, order))
+            {
+              // one operation per order per batch, and the flush may finalise the order
+              SubmitOrderOperations(batch);
+              order = GetRandomLiveOrder();
+            }
+            if (!order)
+              break;
+            batch.push_back(CreateAmendOrder(order));
+          }
+          break;
+        default:
+          SubmitOrderOperations(batch);
+          PerformAction(action);
+          break;
+      }
+    }
+    SubmitOrderOperations(batch);
+  }
+
+  // one throttle window passes on every session
+  void ProcessThrottleQueue()
+  {
+    throttle.ProcessWindow([this](OperationHandle handle) { SendToMarket(handle); });
+    if (waiters)
+      ResolveWaiters(nullptr, OperationOutcome::Sent);
+  }
+
+  // the exchange acked the operation
+  void AckOperation(OperationHandle handle)
+  {
+    AckOperation(operationSlots[handle]);
+  }
+
+  void AckOrderOperations()
+  {
+    // TODO randomise a little
+    std::uniform_int_distribution<> distribution(0, MaxOperationsToAcknowledge);
+    int numItemsToAck = distribution(random_engine);
+    int itemsAcked = 0;
+    for (auto& header : orders)
+    {
+      if (itemsAcked == numItemsToAck)
+        return;
+      if (header.orderState == OrderState::Finalised)
+        continue;
+      if (header.unackedOperations == 0)
+        continue; // nothing in flight, no need to walk the history
+      Order& order = orderSlots[header.order];
+      for (OperationHandle handle : order.operations)
+      {
+        if (itemsAcked == numItemsToAck)
+          break;
+        Operation& operation = operationSlots[handle];
+        if (operation.operationState == OperationState::SentToMarket)
+        {
+          AckOperation(operation);
+          ++itemsAcked;
+        }
+      }
+    }
+  }
+
+  // Strategy API, for coroutine strategies and anything else that drives its own orders. Prices and
+  // quantities are checked and sent or queued exactly as generated ones are. The handle returned is the
+  // operation to await; one the cross check rejected is already stale and awaits as Discarded.
+  OperationHandle InsertOrder(uint8_t strategy, Side side, int price, int qty)
+  {
+    assert(strategy > 0 && strategy < Strategies.size() && "the quoter doesn't place orders");
+    std::vector<OperationHandle> batch { CreateInsertOrder(strategy, side, price, qty) };
+    OperationHandle handle = batch.front();
+    orderSlots[operationSlots[handle].order].Header().driven = true;
+    SubmitOrderOperations(batch);
+    return handle;
+  }
+
+  // An amend crossing the book is discarded and the order deleted, as for generated amends. An order no
+  // longer live is left alone and a null handle returned.
+  OperationHandle AmendOrder(OrderHandle order, int price, int qty)
+  {
+    if (!IsLive(order))
+      return OperationHandle();
+    std::vector<OperationHandle> batch { CreateAmendOrder(&orderSlots[order], price, qty) };
+    OperationHandle handle = batch.front();
+    SubmitOrderOperations(batch);
+    return handle;
+  }
+
+  OperationHandle DeleteOrder(OrderHandle order)
+  {
+    return IsLive(order) ? DeleteOrder(&orderSlots[order]) : OperationHandle();
+  }
+
+  // the order the operation belongs to, or a null handle once the operation is freed
+  OrderHandle OrderFor(OperationHandle operation)
+  {
+    return operationSlots.Contains(operation) ? operationSlots[operation].order : OrderHandle();
+  }
+
+  // on the market or on its way there, and not being deleted
+  bool IsLive(OrderHandle order) const
+  {
+    if (!orderSlots.Contains(order))
+      return false;
+    OrderState state = orderSlots[order].Header().orderState;
+    return (state == OrderState::OnMarket || state == OrderState::PriorToMarket) && !orderSlots[order].Header().isQuote;
+  }
+
+  // what a strategy co_awaits, see Sent, Acked and NextWindow
+  class StrategyAwaiter
+  {
+  public:
+    bool await_ready() const { return ready; }
+
+    void await_suspend(std::coroutine_handle<> strategy)
+    {
+      waiter.strategy = strategy;
+      waiter.next = manager.waiters;
+      manager.waiters = &waiter;
+    }
+
+    OperationOutcome await_resume() const { return waiter.outcome; }
+
+  private:
+    friend class OrderManager;
+
+    StrategyAwaiter(OrderManager& manager, StrategyWait wait, OperationHandle operation)
+      : manager(manager)
+    {
+      waiter.wait = wait;
+      waiter.operation = operation;
+    }
+
+    OrderManager& manager;
+    StrategyWaiter waiter; // lives in the awaiting strategy's frame
+    bool ready = false;
+  };
+
+  // resumes the strategy once the operation has left the throttle (or is acked or discarded)
+  StrategyAwaiter Sent(OperationHandle operation)
+  {
+    return Await(StrategyWait::Sent, operation);
+  }
+
+  // resumes the strategy once the operation is acked or discarded
+  StrategyAwaiter Acked(OperationHandle operation)
+  {
+    return Await(StrategyWait::Acked, operation);
+  }
+
+  // resumes the strategy after the next throttle window, e.g. to retry once the book has moved on
+  StrategyAwaiter NextWindow()
+  {
+    return StrategyAwaiter(*this, StrategyWait::Window, OperationHandle());
+  }
+
+  // Takes ownership of the strategy, which first runs on the next RunStrategies. A strategy is ready
+  // at most once at a time, so with room for every strategy neither ready list allocates when a wait
+  // ends; only spawning grows them.
+  void Spawn(StrategyTask task)
+  {
+    strategyTasks.push_back(task.Release());
+    readyStrategies.reserve(strategyTasks.size());
+    resumingStrategies.reserve(strategyTasks.size());
+    readyStrategies.push_back(strategyTasks.back());
+  }
+
+  // Resumes every strategy whose wait is over, in the order they became ready, including any that
+  // become ready while this runs. Called by the event loop between steps, never by a strategy.
+  void RunStrategies()
+  {
+    if (readyStrategies.empty())
+      return;
+    while (!readyStrategies.empty())
+    {
+      // those readied while this round runs wait for the next
+      std::swap(readyStrategies, resumingStrategies);
+      for (std::coroutine_handle<> strategy : resumingStrategies)
+        strategy.resume();
+      resumingStrategies.clear();
+    }
+    std::erase_if(strategyTasks, [](std::coroutine_handle<> strategy)
+    {
+      if (!strategy.done())
+        return false;
+      strategy.destroy();
+      return true;
+    });
+  }
+
+  // where strategy coroutine frames are allocated, see StrategyTask
+  std::pmr::memory_resource* StrategyFrames()
+  {
+    return &strategyFrames;
+  }
+
+  // Property checks for stress runs (--check), covering the order manager's bookkeeping as well as
+  // the cross invariant. Returns a description of the first broken invariant, or nullptr.
+  const char* FindBrokenInvariant()
+  {
+    for (int price = UpperPrice; price > 0; --price)
+      if (exchange.Depth().bids[price] && exchange.Depth().asks[price])
+        return "bid and ask shown at the same price level";
+
+    if (!orderSlots.Contains(quotes) || !orderSlots[quotes].Header().isQuote || orderSlots[quotes].Header().orderState == OrderState::Finalised)
+      return "quote freed or finalised";
+
+    size_t queuedOperations = 0;
+    for (auto& header : orders)
+    {
+      Order& order = orderSlots[header.order];
+      int queued = 0;
+      int unacked = 0;
+      for (auto it = order.operations.begin(); it != order.operations.end(); ++it)
+      {
+        if (!operationSlots.Contains(*it))
+          return "order history holds a stale handle";
+        Operation& operation = operationSlots[*it];
+        if (operation.order != header.order)
+          return "operation held in another order's history";
+        if (operation.operationState == OperationState::SentToMarket)
+          ++unacked;
+        if (operation.operationState != OperationState::Queued)
+          continue;
+        ++queued;
+        const std::vector<OperationHandle>& queue = throttle.QueueFor(order).operations;
+        if (std::count(queue.begin(), queue.end(), *it) != 1)
+          return "queued operation not in its strategy's throttle queue exactly once";
+        // sending will look the previous operation up in the market book, so it must still be alive
+        if (operation.previousOperation && std::find(order.operations.begin(), it, operation.previousOperation) == it)
+          return "queued operation chained to an operation missing from its order's history";
+      }
+      if (queued > 1)
+        return "more than one queued operation for an order";
+      if (unacked != header.unackedOperations)
+        return "in flight count out of step with the operation history";
+      if (!ExposureInStep(header))
+        return "exposure index out of step with the operation history";
+      queuedOperations += queued;
+    }
+    size_t sessionQueued = 0;
+    for (const Session& session : throttle.Sessions())
+      sessionQueued += Throttle::QueuedOperationCount(session);
+    if (queuedOperations != sessionQueued)
+      return "throttle holds operations that are not in any order's history";
+    std::array<long, SessionCount> inFlight {};
+    for (auto& header : orders)
+      inFlight[header.session] += header.unackedOperations;
+    for (size_t session = 0; session < inFlight.size(); ++session)
+      if (inFlight[session] != throttle.Sessions()[session].inFlight)
+        return "session in flight count out of step with its orders";
+
+    for (const StrategyWaiter* waiter = waiters; waiter; waiter = waiter->next)
+      if (waiter->wait != StrategyWait::Window
+          && (!operationSlots.Contains(waiter->operation) || operationSlots[waiter->operation].operationState == OperationState::Acked))
+        return "strategy still waiting on an operation that is acked or freed";
+
+    std::vector<const Order*> ordersOnMarket;
+    for (OperationHandle handle : exchange.MarketOperations())
+    {
+      if (!operationSlots.Contains(handle))
+        return "market book holds a stale handle";
+      const Operation& operation = operationSlots[handle];
+      if (operation.operationState != OperationState::SentToMarket && operation.operationState != OperationState::Acked)
+        return "market book holds an operation that was never sent";
+      if (!orderSlots.Contains(operation.order))
+        return "market book holds an operation of a freed order";
+      ordersOnMarket.push_back(&orderSlots[operation.order]);
+    }
+    std::sort(ordersOnMarket.begin(), ordersOnMarket.end());
+    if (std::adjacent_find(ordersOnMarket.begin(), ordersOnMarket.end()) != ordersOnMarket.end())
+      return "order shown on the market more than once";
+    return nullptr;
+  }
+
+  // Frees finalised orders once there are more than orderLimit, and trims the oldest quoteTrim quote
+  // operations once the history is longer than quoteLimit and the trimmed ones are all acked.
+  void ReclaimMemory(size_t orderLimit, size_t quoteLimit, size_t quoteTrim)
+  {
+    // only clear memory once and a while
+    if (orders.size() > orderLimit)
+    {
+      // the quote is never freed, whatever its state
+      EraseOrders([](const OrderHeader& header) { return header.orderState == OrderState::Finalised && !header.isQuote; });
+      std::cout << "CLEARING ORDERS" << std::endl;
+    }
+
+    // just remove most of the acked quotes, if any of the remainder are already acked
+    Order& quote = orderSlots[quotes];
+    if (quote.operations.size() > quoteLimit)
+    {
+      if (operationSlots[quote.operations[quoteTrim]].operationState == OperationState::Acked)
+      {
+        for (size_t i = 0; i < quoteTrim; ++i)
+          EraseOperation(quote.operations[i]);
+        quote.operations.erase(quote.operations.begin(), quote.operations.begin() + quoteTrim);
+        std::cout << "CLEARING QUOTES" << std::endl;
+      }
+    }
+  }
+
+  AmendCheckCounts amendChecks;
+  ConflationCounts conflations;
+  long quotesNotPriced = 0; // skipped as they would only have been conflated
+  long staleQuotesSent = 0; // went out with a price older than one that was skipped
+  // counts rather than windows, taken on every send: operations in flight on its session, and on its
+  // order, which is how many prices the order may be showing at once
+  LatencyHistogram inFlightAtSend;
+  LatencyHistogram unackedAtSend;
+
+private:
+  PrintedOrder Print(const Order& order) const
+  {
+    return PrintedOrder{order, operationSlots};
+  }
+
+  Order* NewOrder()
+  {
+    orders.push_back(OrderHeader());
+    orders.back().order = orderSlots.Insert(&operationHistoryPool);
+    Order& order = orderSlots[orders.back().order];
+    order.index = orders.size() - 1;
+    order.headers = &orders;
+    return &order;
+  }
+
+  StrategyAwaiter Await(StrategyWait wait, OperationHandle handle)
+  {
+    StrategyAwaiter awaiter(*this, wait, handle);
+    if (!operationSlots.Contains(handle))
+      awaiter.ready = true; // discarded
+    else if (operationSlots[handle].operationState == OperationState::Acked)
+    {
+      awaiter.waiter.outcome = OperationOutcome::Acked;
+      awaiter.ready = true;
+    }
+    else if (operationSlots[handle].operationState == OperationState::SentToMarket && wait == StrategyWait::Sent)
+    {
+      awaiter.waiter.outcome = OperationOutcome::Sent;
+      awaiter.ready = true;
+    }
+    return awaiter;
+  }
+
+  // Readies the strategies waiting on what just happened to the operation, or with a null operation,
+  // those waiting for the throttle window. They run on the next RunStrategies.
+  void ResolveWaiters(const Operation* operation, OperationOutcome outcome)
+  {
+    for (StrategyWaiter** link = &waiters; *link;)
+    {
+      StrategyWaiter& waiter = **link;
+      bool due = operation ? waiter.wait != StrategyWait::Window && &operationSlots[waiter.operation] == operation
+                               && (outcome != OperationOutcome::Sent || waiter.wait == StrategyWait::Sent)
+                           : waiter.wait == StrategyWait::Window;
+      if (!due)
+      {
+        link = &waiter.next;
+        continue;
+      }
+      if (operation)
+        waiter.outcome = outcome;
+      *link = waiter.next;
+      readyStrategies.push_back(waiter.strategy);
+    }
+  }
+
+  // frees the operation, telling any strategy waiting on it that it was discarded
+  void EraseOperation(OperationHandle handle)
+  {
+    if (waiters)
+      ResolveWaiters(&operationSlots[handle], OperationOutcome::Discarded);
+    operationSlots.Erase(handle);
+  }
+
+  // appends a new operation to the order's history
+  OperationHandle NewOperation(Order& order)
+  {
+    order.operations.push_back(operationSlots.Insert(order.Header().order));
+    operationSlots[order.operations.back()].createdWindow = throttle.Window();
+    return order.operations.back();
+  }
+
+  // frees the order and its operation history
+  void ReleaseOrder(OrderHandle handle)
+  {
+    for (OperationHandle operation : orderSlots[handle].operations)
+      EraseOperation(operation);
+    orderSlots.Erase(handle);
+  }
+
+  // compacts `orders`, releasing the erased ones and keeping each order's back reference to its header
+  // in step
+  template <typename P>
+  void EraseOrders(P predicate)
+  {
+    orders.erase(std::remove_if(orders.begin(), orders.end(), [this, &predicate](const OrderHeader& header)
+    {
+      if (!predicate(header))
+        return false;
+      ReleaseOrder(header.order);
+      return true;
+    }), orders.end());
+    for (uint32_t index = 0; index < orders.size(); ++index)
+      orderSlots[orders[index].order].index = index;
+  }
+
+  // most aggressive price the order could be at: highest for buys, lowest for sells
+  template <Side S>
+  int GetLivePrice(Order& order)
+  {
+    int inflightPrice = order.price;
+    int lastAckedPrice = order.price;
+    for (OperationHandle handle : order.operations)
+    {
+      const Operation& operation = operationSlots[handle];
+      if (operation.operationType == OperationType::AmendOrder || operation.operationType == OperationType::InsertOrder)
+      {
+        if (operation.operationState == OperationState::Acked)
+        {
+          // the very latest ack price should be taken into account
+          lastAckedPrice = operation.orderPayload.price;
+        }
+        else
+        {
+          // take any pending price into account
+          inflightPrice = SideTraits<S>::Better(operation.orderPayload.price, inflightPrice);
+        }
+      }
+    }
+    return SideTraits<S>::Better(inflightPrice, lastAckedPrice);
+  }
+
+  bool IsExposed(const OrderHeader& header)
+  {
+    if (header.isQuote)
+      return false; // quote legs are checked separately
+    if (header.orderState == OrderState::DeleteSentToMarket)
+    {
+      // still showing until the delete actually goes out, which another session may beat
+      const Operation& lastOperation = operationSlots[orderSlots[header.order].operations.back()];
+      return lastOperation.operationState == OperationState::Initial || lastOperation.operationState == OperationState::Queued;
+    }
+    return header.orderState != OrderState::Finalised;
+  }
+
+  uint64_t ComputeExposure(const OrderHeader& header)
+  {
+    if (!IsExposed(header))
+      return 0; // gone or going, can't be in cross
+    const Order& order = orderSlots[header.order];
+    uint64_t levels = uint64_t(1) << order.price;
+    int lastAckedPrice = order.price;
+    for (OperationHandle handle : order.operations)
+    {
+      const Operation& operation = operationSlots[handle];
+      if (operation.operationType == OperationType::AmendOrder || operation.operationType == OperationType::InsertOrder)
+      {
+        if (operation.operationState == OperationState::Acked)
+          lastAckedPrice = operation.orderPayload.price;
+        else
+          levels |= uint64_t(1) << operation.orderPayload.price;
+      }
+    }
+    return levels | uint64_t(1) << lastAckedPrice;
+  }
+
+  template <Side S>
+  void RefreshPriceHeap(LivePriceHeap<S>& heap, Order& order)
+  {
+    if (IsExposed(order.Header()))
+      heap.Update(order, GetLivePrice<S>(order));
+    else
+      heap.Remove(order);
+  }
+
+  // brings the index up to date after the order's state or history changed
+  void RefreshExposure(Order& order)
+  {
+    OrderHeader& header = order.Header();
+    if constexpr (!UseLevelBitmap)
+    {
+      if (header.side == Side::Buy)
+        RefreshPriceHeap(buyPriceHeap, order);
+      else
+        RefreshPriceHeap(sellPriceHeap, order);
+      return;
+    }
+
+    uint64_t levels = ComputeExposure(header);
+    if (levels == header.exposure)
+      return;
+    ExposureIndex& index = exposureIndex[(int)header.side];
+    for (uint64_t removed = header.exposure & ~levels; removed; removed &= removed - 1)
+    {
+      int price = std::countr_zero(removed);
+      if (--index.counts[price] == 0)
+        index.occupied &= ~(uint64_t(1) << price);
+    }
+    for (uint64_t added = levels & ~header.exposure; added; added &= added - 1)
+    {
+      int price = std::countr_zero(added);
+      if (index.counts[price]++ == 0)
+        index.occupied |= uint64_t(1) << price;
+    }
+    header.exposure = levels;
+  }
+
+  // most aggressive price any live order on side S could be showing
+  template <Side S>
+  int GetBestExposedPrice()
+  {
+    if constexpr (!UseLevelBitmap)
+      return S == Side::Buy ? buyPriceHeap.Best() : sellPriceHeap.Best();
+    return SideTraits<S>::BestLevel(exposureIndex[(int)S].occupied);
+  }
+
+  // the order's live price as of its last refresh, a live order's only
+  template <Side S>
+  int GetIndexedLivePrice(const OrderHeader& header)
+  {
+    if constexpr (!UseLevelBitmap)
+    {
+      if constexpr (S == Side::Buy)
+        return buyPriceHeap.PriceOf(header);
+      else
+        return sellPriceHeap.PriceOf(header);
+    }
+    return SideTraits<S>::BestLevel(header.exposure);
+  }
+
+  // is the order indexed where its history says it should be
+  bool ExposureInStep(const OrderHeader& header)
+  {
+    if constexpr (!UseLevelBitmap)
+    {
+      if (!IsExposed(header))
+        return header.heapSlot == LivePriceHeap<Side::Buy>::NotInHeap;
+      if (header.side == Side::Buy)
+        return buyPriceHeap.Holds(header, GetLivePrice<Side::Buy>(orderSlots[header.order]));
+      return sellPriceHeap.Holds(header, GetLivePrice<Side::Sell>(orderSlots[header.order]));
+    }
+    return header.exposure == ComputeExposure(header);
+  }
+
+  // most aggressive price the quote leg on side S could be showing (last ack or anything in flight)
+  template <Side S>
+  int GetLiveQuotePrice()
+  {
+    int lastAckedPrice = SideTraits<S>::WorstPrice;
+    int bestUnackedPrice = SideTraits<S>::WorstPrice;
+    for (OperationHandle handle : orderSlots[quotes].operations)
+    {
+      const Operation& quoteOperation = operationSlots[handle];
+      if (SideTraits<S>::QuoteQty(quoteOperation) == -1)
+        continue; // no active quote
+      if (quoteOperation.operationState == OperationState::Acked)
+        lastAckedPrice = SideTraits<S>::QuotePrice(quoteOperation);
+      else
+        bestUnackedPrice = SideTraits<S>::Better(bestUnackedPrice, SideTraits<S>::QuotePrice(quoteOperation));
+    }
+    return SideTraits<S>::Better(lastAckedPrice, bestUnackedPrice);
+  }
+
+  // checks a pending order against the opposing quote and the most aggressive opposing order price
+  template <Side S>
+  bool CheckPendingInsertOrAmend(Order& pendingOrder, int quotePrice, int opposingPrice)
+  {
+    // only called for new orders and amends that beat every live price, so the order's price is its
+    // live price
+    // check quotes first
+    if (SideTraits<S>::Through(pendingOrder.price, quotePrice))
+    {
+      std::cout << "* " << SideTraits<S>::Name << " order crosses with existing quote at price level " << quotePrice << std::endl;
+      return false; // will cross with quote
+    }
+    if (SideTraits<S>::Through(pendingOrder.price, opposingPrice))
+    {
+      std::cout << "* " << SideTraits<S>::Name << " order crosses with existing order" << std::endl;
+      return false;
+    }
+    return true;
+  }
+
+  void RemoveDiscardedOperations(Operation& operation)
+  {
+    Order& order = orderSlots[operation.order];
+    auto& operations = order.operations;
+    Operation* thisOperation = &operation;
+    bool flag = true;
+    operations.erase(std::remove_if(operations.begin(), operations.end(), [this, thisOperation, &flag](OperationHandle handle)
+    {
+      Operation& other = operationSlots[handle];
+      if (&other != thisOperation)
+      {
+        if (other.operationState == OperationState::Queued)
+        {
+            if (flag)
+              thisOperation->previousOperation = other.previousOperation;
+            flag = false;
+            std::cout << "Removing operation from order: " << other << std::endl;
+            EraseOperation(handle);
+            return true;
+        }
+      }
+      return false;
+    }), operations.end());
+    RefreshExposure(order);
+  }
+
+  void SendToMarket(OperationHandle handle)
+  {
+    Operation& operation = operationSlots[handle];
+    operation.operationState = OperationState::SentToMarket;
+    std::cout << "Operation sent to market, " << operation << std::endl;
+    throttle.RecordSend(operation);
+    if (operation.operationType == OperationType::InsertQuote && std::exchange(quotePricingSkipped, false))
+      ++staleQuotesSent;
+
+    // update order manager
+    Order& order = orderSlots[operation.order];
+    OrderHeader& header = order.Header();
+    ++header.unackedOperations;
+    if (operation.operationType == OperationType::DeleteOrder || operation.operationType == OperationType::DeleteQuote)
+      header.orderState = OrderState::DeleteSentToMarket;
+    else
+      header.orderState = OrderState::OnMarket;
+    if (operation.operationType == OperationType::DeleteOrder)
+      RefreshExposure(order); // off the book from now on
+    inFlightAtSend.Record(throttle.SessionFor(order).inFlight);
+    unackedAtSend.Record(header.unackedOperations);
+    if (waiters)
+      ResolveWaiters(&operation, OperationOutcome::Sent);
+
+    exchange.Send(handle, operationSlots, header);
+  }
+
+  int RandomPrice(int lower, int upper)
+  {
+    std::uniform_int_distribution<> distribution(lower, upper);
+    return distribution(random_engine);
+  }
+
+  int RandomPrice()
+  {
+    return RandomPrice(1, UpperPrice);
+  }
+
+  int RandomQty()
+  {
+    std::uniform_int_distribution<> distribution(1, UpperVolume);
+    return distribution(random_engine);
+  }
+
+  Side RandomSide()
+  {
+    std::uniform_int_distribution<> distribution((int)Side::Buy, (int)Side::Sell);
+    return (Side)distribution(random_engine);
+  }
+
+  OperationHandle CreateInsertOrder()
+  {
+    int price = RandomPrice();
+    int qty = RandomQty();
+    Side side = RandomSide();
+    OperationHandle handle = CreateInsertOrder(nextOrderStrategy, side, price, qty);
+    nextOrderStrategy = nextOrderStrategy + 1 < Strategies.size() ? nextOrderStrategy + 1 : 1;
+    return handle;
+  }
+
+  OperationHandle CreateInsertOrder(uint8_t strategy, Side side, int price, int qty)
+  {
+    assert(price > 0 && price <= UpperPrice && qty > 0 && qty <= UpperVolume);
+    Order* order = NewOrder();
+    order->price = price;
+    order->qty = qty;
+    order->Header().side = side;
+    order->Header().orderState = OrderState::PriorToMarket;
+    order->Header().strategy = strategy;
+    order->Header().session = throttle.LeastLoadedSession();
+
+    OperationHandle handle = NewOperation(*order);
+    Operation* operation = &operationSlots[handle];
+    operation->operationType = OperationType::InsertOrder;
+    operation->operationState = OperationState::Initial;
+    operation->orderPayload.price = order->price;
+    operation->orderPayload.qty = order->qty;
+
+    std::cout << "Order insert: " << Print(*order) << std::endl;
+    return handle;
+  }
+
+  Order* GetRandomLiveOrder()
+  {
+    std::uniform_int_distribution<> uniform_dist(0, orders.size());
+    const int maxAttempts = orders.size();
+    int i = 0;
+    while (i++ < maxAttempts)
+    {
+      int orderIndex = uniform_dist(random_engine);
+      auto it = orders.begin() + orderIndex;
+      if (it != orders.end())
+      {
+          if (it->orderState == OrderState::OnMarket || it->orderState == OrderState::PriorToMarket)
+          {
+            if (!it->isQuote && !it->driven)
+              return &orderSlots[it->order];
+          }
+      }
+    }
+    return nullptr;
+  }
+
+  OperationHandle CreateAmendOrder(Order* order)
+  {
+    int price = RandomPrice();
+    int qty = RandomQty();
+    return CreateAmendOrder(order, price, qty);
+  }
+
+  OperationHandle CreateAmendOrder(Order* order, int price, int qty)
+  {
+    assert(price > 0 && price <= UpperPrice && qty > 0 && qty <= UpperVolume);
+    // update price/qty of order immediately
+    order->price = price;
+    order->qty = qty;
+    OperationHandle previousHandle = order->operations.back();
+    Operation* previousOperation = &operationSlots[previousHandle];
+    ++conflations.amends;
+    if (previousOperation->operationState == OperationState::Queued)
+    {
+      ++conflations.amendsConflated;
+      // not sent yet, so rewrite it where it waits in the throttle (an insert stays an insert)
+      previousOperation->orderPayload.price = order->price;
+      previousOperation->orderPayload.qty = order->qty;
+      std::cout << "Order amend to " << order->qty << "@" << order->price << " conflated into queued operation: " << *previousOperation << std::endl;
+      return previousHandle;
+    }
+    OperationHandle handle = NewOperation(*order);
+    Operation* operation = &operationSlots[handle];
+    operation->previousOperation = previousHandle;
+    operation->operationType = OperationType::AmendOrder;
+    operation->operationState = OperationState::Initial;
+    operation->orderPayload.price = order->price;
+    operation->orderPayload.qty = order->qty;
+    std::cout << "Order amend to " << order->qty << "@" << order->price << " [" << Print(*order) << "], previous operation: " << *previousOperation << std::endl;
+    return handle;
+  }
+
+  bool IsInBatch(const std::vector<OperationHandle>& batch, const Order* order)
+  {
+    return std::any_of(batch.begin(), batch.end(), [this, order](OperationHandle handle) { return operationSlots[handle].order == order->Header().order; });
+  }
+
+  // An amend only adds its price to the prices the order could be showing, so an amend to a price no
+  // more aggressive than the order's indexed live price can't cross anything the order didn't already
+  // avoid. Those skip the cross check; the rest are checked as new orders at their new price.
+  template <Side S>
+  bool CheckPendingOrderOperation(const Operation& operation, int quotePrice)
+  {
+    if (operation.operationType == OperationType::AmendOrder)
+    {
+      if (operation.orderPayload.price == operationSlots[operation.previousOperation].orderPayload.price)
+      {
+        ++amendChecks.qtyOnly;
+        return true;
+      }
+      int livePrice = GetIndexedLivePrice<S>(orderSlots[operation.order].Header());
+      if (SideTraits<S>::Better(operation.orderPayload.price, livePrice) == livePrice)
+      {
+        ++amendChecks.passiveReprice;
+        return true;
+      }
+      ++amendChecks.aggressiveReprice;
+    }
+    return CheckPendingInsertOrAmend<S>(orderSlots[operation.order], quotePrice, GetBestExposedPrice<SideTraits<S>::Opposite>());
+  }
+
+  // Cross checks a burst of inserts/amends (at most one per order) against the exposure index, then
+  // sends or queues the survivors in submission order. Each operation is indexed once accepted, so it is
+  // checked against exactly what checking them one at a time would see. Amends conflated into a queued
+  // operation keep its place in the throttle. Clears the batch.
+  void SubmitOrderOperations(std::vector<OperationHandle>& batch)
+  {
+    if (batch.empty())
+      return;
+
+    int bidQuotePrice = GetLiveQuotePrice<Side::Buy>();
+    int askQuotePrice = GetLiveQuotePrice<Side::Sell>();
+
+    for (OperationHandle handle : batch)
+    {
+      Operation* operation = &operationSlots[handle];
+      Order* order = &orderSlots[operation->order];
+      bool conflated = operation->operationState == OperationState::Queued;
+      bool isBuy = order->Header().side == Side::Buy;
+      bool accepted = isBuy ? CheckPendingOrderOperation<Side::Buy>(*operation, askQuotePrice)
+                            : CheckPendingOrderOperation<Side::Sell>(*operation, bidQuotePrice);
+      if (!accepted)
+      {
+        if (conflated)
+        {
+          std::cout << "*** Order amend crossed, rejecting queued operation: " << *operation << std::endl;
+          DeleteOrder(order); // takes the queued operation out of the throttle too
+        }
+        else if (operation->operationType == OperationType::InsertOrder)
+        {
+          std::cout << "*** Order insert crossed, rejecting operation: " << *operation << std::endl;
+          EraseOrders([order](const OrderHeader& header) { return &header == &order->Header(); });
+        }
+        else
+        {
+          std::cout << "*** Order amend crossed, rejecting operation: " << *operation << std::endl;
+          order->operations.pop_back();
+          EraseOperation(handle);
+          // clear up order (on market and/or in queue)
+          DeleteOrder(order);
+        }
+        continue;
+      }
+
+      RefreshExposure(*order);
+      if (conflated)
+        continue;
+
+      if (!throttle.Check(*operation))
+      {
+         std::cout << "Throttle closed" << std::endl;
+         throttle.Push(handle);
+      }
+      else
+      {
+        assert(!operation->previousOperation || operationSlots[operation->previousOperation].operationState != OperationState::Queued);
+        SendToMarket(handle);
+      }
+    }
+    batch.clear();
+  }
+
+  // does the side S leg of the quote cross anything the opposing orders could be showing
+  template <Side S>
+  bool QuoteLegCrosses(const Operation& quoteOperation)
+  {
+    if (SideTraits<S>::QuoteQty(quoteOperation) == -1)
+      return false; // no leg on this side
+    if (!SideTraits<S>::Through(SideTraits<S>::QuotePrice(quoteOperation), GetBestExposedPrice<SideTraits<S>::Opposite>()))
+      return false;
+    std::cout << "* Quote " << SideTraits<S>::LegName << " crosses with existing order" << std::endl;
+    return true;
+  }
+
+  bool CheckPendingQuote(Operation* quoteOperation)
+  {
+    // we assume that quotes won't cross with each other
+    return !QuoteLegCrosses<Side::Buy>(*quoteOperation) && !QuoteLegCrosses<Side::Sell>(*quoteOperation);
+  }
+
+  void InitQuotes()
+  {
+    Order* order = NewOrder();
+    quotes = order->Header().order;
+    order->Header().isQuote = true;
+    order->price = 0;
+    order->qty = -1;
+    order->Header().side = RandomSide(); // not important here
+    order->Header().orderState = OrderState::PriorToMarket;
+    throttle.Subscribe([this](const ThrottleState& state)
+    {
+      if (state.session == orderSlots[quotes].Header().session)
+        quoterSeesThrottleClosed = state.closed;
+    });
+  }
+
+  void AckOperation(Operation& operation)
+  {
+    std::cout << "Acked operation " << operation << std::endl;
+    Order& order = orderSlots[operation.order];
+    OrderHeader& header = order.Header();
+    operation.operationState = OperationState::Acked;
+    --header.unackedOperations;
+    throttle.RecordAck(order);
+    RefreshExposure(order);
+    if (operation.operationType == OperationType::DeleteOrder)
+    {
+      header.orderState = OrderState::Finalised;
+    }
+    else
+    {
+      // only mark as on market if we haven't already marked this as deleting
+      if (header.orderState != OrderState::DeleteSentToMarket)
+        header.orderState = OrderState::OnMarket;
+    }
+    if (waiters)
+      ResolveWaiters(&operation, OperationOutcome::Acked);
+  }
+
+  // backs the operation history of every order, so histories recycle each other's storage
+  std::pmr::unsynchronized_pool_resource operationHistoryPool;
+  std::vector<OrderHeader> orders;
+  // every order and operation lives here; containers across the order manager hold handles to them
+  SlotMap<Order> orderSlots;
+  SlotMap<Operation> operationSlots;
+  ExchangeSimulator& exchange; // where sends go
+  DecisionSource& random_engine;
+  Throttle throttle;
+  // the quote object for order manager (not market book)
+  OrderHandle quotes;
+  std::array<ExposureIndex, 2> exposureIndex; // by Side
+  LivePriceHeap<Side::Buy> buyPriceHeap;
+  LivePriceHeap<Side::Sell> sellPriceHeap;
+  size_t nextOrderStrategy = 1; // new orders are shared round robin between the non quoting strategies
+  bool quoterSeesThrottleClosed = false;
+  bool quotePricingSkipped = false; // since the queued quote was last priced
+  // coroutine strategies: their frames, all those not yet finished, those due to resume and the waits
+  // the rest are suspended on
+  std::pmr::unsynchronized_pool_resource strategyFrames;
+  std::vector<std::coroutine_handle<>> strategyTasks;
+  std::vector<std::coroutine_handle<>> readyStrategies;
+  std::vector<std::coroutine_handle<>> resumingStrategies; // the round RunStrategies is resuming
+  StrategyWaiter* waiters = nullptr;
+};
+
+inline void* StrategyTask::promise_type::operator new(size_t size, OrderManager& manager, uint8_t, DecisionSource&)
+{
+  return Allocate(size, manager.StrategyFrames());
+}
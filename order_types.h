@@ -0,0 +1,639 @@
+// Types shared by the order manager, its throttle and the exchange simulator: orders and their
+// operations, the handles and slot maps they are held by, and the per side price ordering.
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <cassert>
+#include <cmath>
+#include <cstdint>
+#include <deque>
+#include <iostream>
+#include <limits>
+#include <memory_resource>
+#include <new>
+#include <random>
+#include <stdexcept>
+#include <string_view>
+#include <vector>
+
+const int SessionCount = 2; // exchange sessions, each throttled on its own
+const int MaxOperationsToGenerateAtATime = 10;
+const int MaxOperationsToAcknowledge = 10;
+const int UpperPrice = 9;
+const int UpperVolume = 100;
+
+// operation payloads are stored as 16 bit values to keep Operation within half a cache line
+static_assert(UpperPrice <= INT16_MAX && UpperVolume <= INT16_MAX, "price/volume must fit the packed operation payload");
+// Narrow price grids index live order prices with a bit per level, wider ones with a heap per side
+#ifdef THROTTLING_PRICE_HEAP
+const bool UseLevelBitmap = false; // force the heap, e.g. to exercise it on a narrow grid
+#else
+const bool UseLevelBitmap = UpperPrice < 64;
+#endif
+
+enum class Action
+{
+  INSERT_ORDER,
+  QUOTE_ONCE,
+  QUOTE_TWICE,
+  QUOTE_THREE_TIMES,
+  QUOTE_FOUR_TIMES,
+  QUOTE_FIVE_TIMES,
+  QUOTE_SIX_TIMES,
+  AMEND_ONCE,
+  AMEND_TWICE,
+  AMEND_THREE_TIMES,
+  DELETE_ORDER,
+  DELETE_QUOTE
+};
+
+enum class OrderState : uint8_t
+{
+  PriorToMarket,
+  OnMarket, // sent to market, possibly not yet acknowledged
+  DeleteSentToMarket,
+  Finalised // gone
+};
+
+enum class OperationType : uint8_t
+{
+  InsertOrder,
+  InsertQuote,
+  AmendOrder,
+  DeleteOrder,
+  DeleteQuote
+};
+
+// Throttle units each message uses up, by OperationType. Quotes are charged per leg; a venue that lets
+// cancels through free would set the deletes to 0.
+const std::array<int, 5> OperationTypeCost {
+  1, // InsertOrder
+  1, // InsertQuote, per leg
+  1, // AmendOrder
+  1, // DeleteOrder
+  1  // DeleteQuote
+};
+
+// Strategies sharing the throttled session. Each queues in its own part of the throttle, and a drain
+// shares out the window between those with a backlog in proportion to their weights.
+struct Strategy
+{
+  const char* name;
+  int weight; // throttle units credited per round of the drain
+};
+
+const std::array<Strategy, 3> Strategies {{
+  {"quoter", 1}, // owns the quote
+  {"orders A", 2},
+  {"orders B", 1}
+}};
+
+enum class OperationState : uint8_t
+{
+  Initial,
+  Queued,
+  SentToMarket,
+  Acked
+};
+
+// 64 bit reference to an object in a SlotMap: the slot index, plus the generation the slot was on
+// when the object was put there so that a handle that outlived its object can be told apart from one
+// to whatever reuses the slot. The default handle refers to nothing.
+template <typename T>
+struct Handle
+{
+  static constexpr uint32_t IndexBits = 22;
+  static constexpr uint64_t IndexMask = (uint64_t(1) << IndexBits) - 1;
+  static constexpr uint32_t GenerationBits = 64 - IndexBits;
+
+  uint64_t value = 0;
+
+  uint32_t Index() const { return value & IndexMask; }
+  explicit operator bool() const { return value != 0; }
+  bool operator==(const Handle&) const = default;
+};
+
+// Owns objects at stable addresses and hands out Handles to them. A slot's generation is odd while it
+// is occupied and is bumped on every insert and erase, so no live handle is ever 0. operator[] only
+// asserts the handle is live, so in release builds it trusts the caller; Contains always checks, and is
+// how a handle that may have outlived its object is tested. A handle keeps 42 bits of the generation,
+// so a slot takes 2^41 reuses to wrap: over two days of reusing the one slot ten million times a second.
+// Should one get there it is retired rather than reused, so a stale handle never passes for a live one.
+template <typename T>
+class SlotMap
+{
+public:
+  SlotMap() = default;
+  SlotMap(const SlotMap&) = delete;
+  SlotMap& operator=(const SlotMap&) = delete;
+  ~SlotMap() { Clear(); }
+
+  template <typename... Args>
+  Handle<T> Insert(Args&&... args)
+  {
+    uint32_t index;
+    if (freeSlots.empty())
+    {
+      index = slots.size();
+      if (index > Handle<T>::IndexMask)
+        throw std::length_error("slot map full");
+      slots.emplace_back();
+      generations.push_back(0);
+    }
+    else
+    {
+      index = freeSlots.back();
+      freeSlots.pop_back();
+    }
+    new (slots[index].bytes) T(std::forward<Args>(args)...);
+    uint64_t generation = ++generations[index];
+    return Handle<T>{generation << Handle<T>::IndexBits | index};
+  }
+
+  void Erase(Handle<T> handle)
+  {
+    (*this)[handle].~T();
+    uint64_t generation = ++generations[handle.Index()];
+    if (generation % (uint64_t(1) << Handle<T>::GenerationBits) != 0)
+      freeSlots.push_back(handle.Index()); // else every generation a handle can hold has been used
+  }
+
+  T& operator[](Handle<T> handle)
+  {
+    assert(Contains(handle) && "stale or null handle");
+    return *std::launder(reinterpret_cast<T*>(slots[handle.Index()].bytes));
+  }
+
+  const T& operator[](Handle<T> handle) const
+  {
+    assert(Contains(handle) && "stale or null handle");
+    return *std::launder(reinterpret_cast<const T*>(slots[handle.Index()].bytes));
+  }
+
+  bool Contains(Handle<T> handle) const
+  {
+    uint32_t index = handle.Index();
+    return index < slots.size() && generations[index] % 2 == 1 && (generations[index] << Handle<T>::IndexBits | index) == handle.value;
+  }
+
+  // destroys everything, handles issued before are not detected as stale afterwards
+  void Clear()
+  {
+    for (uint32_t index = 0; index < slots.size(); ++index)
+      if (generations[index] % 2 == 1)
+        std::launder(reinterpret_cast<T*>(slots[index].bytes))->~T();
+    slots.clear();
+    generations.clear();
+    freeSlots.clear();
+  }
+
+private:
+  struct Storage
+  {
+    alignas(T) std::byte bytes[sizeof(T)];
+  };
+
+  std::deque<Storage> slots; // a deque never moves its elements
+  std::vector<uint64_t> generations;
+  std::vector<uint32_t> freeSlots;
+};
+
+struct Order;
+struct Operation;
+using OrderHandle = Handle<Order>;
+using OperationHandle = Handle<Operation>;
+
+// Packed to 32 bytes and aligned so that an operation never straddles a cache line. Orders only use
+// orderPayload and quotes only use quotePayload, so the two share storage: check IsQuote before
+// reading either.
+struct alignas(32) Operation
+{
+  explicit Operation(OrderHandle _order)
+    : order(_order)
+  {
+  }
+
+  OrderHandle order;
+  OperationHandle previousOperation;
+  OperationType operationType;
+  OperationState operationState;
+  struct OrderPayload
+  {
+    int16_t price;
+    int16_t qty;
+  };
+  struct QuotePayload // a qty of -1 means no quote on that side
+  {
+    int16_t bidPrice;
+    int16_t bidQty;
+    int16_t askPrice;
+    int16_t askQty;
+  };
+  union
+  {
+    OrderPayload orderPayload;
+    QuotePayload quotePayload;
+  };
+  uint32_t createdWindow = 0; // throttle window it was created in, for the send latency stats
+};
+
+static_assert(sizeof(Operation) == 32, "Operation should pack into half a cache line");
+
+// only the quote has quote operations, so the type tells which payload is in use
+inline bool IsQuote(const Operation& operation)
+{
+  return operation.operationType == OperationType::InsertQuote || operation.operationType == OperationType::DeleteQuote;
+}
+
+enum class Side : uint8_t
+{
+  Buy,
+  Sell
+};
+
+struct OrderHeader;
+
+// Cold side of an order: its operation history and the values only needed for new operations and
+// diagnostics. The state every scan filters on lives in its OrderHeader.
+struct Order
+{
+  int price;
+  int qty;
+  uint32_t index; // position of this order's header in `headers`
+  std::vector<OrderHeader>* headers; // the owning order manager's
+  std::pmr::vector<OperationHandle> operations; // owned, see OrderManager::operationSlots
+
+  explicit Order(std::pmr::memory_resource* historyResource)
+    : operations(historyResource)
+  {
+  }
+
+  OrderHeader& Header() const;
+};
+
+// Hot side of an order, kept contiguous in the order manager's `orders` so the cross checks and ack
+// scan can skip orders without touching the order itself.
+struct OrderHeader
+{
+  Side side;
+  OrderState orderState;
+  bool isQuote = false;
+  uint8_t strategy = 0; // index into Strategies
+  uint8_t session = 0; // index into the throttle's sessions, fixed for the order's life
+  bool driven = false; // by a coroutine strategy, so the generated workload leaves it alone
+  uint16_t unackedOperations = 0; // sent to market, still waiting for an ack
+  uint64_t exposure = 0; // bit per price level this order counts at in the exposure index
+  uint32_t heapSlot = UINT32_MAX; // position in its side's live price heap, if there
+  OrderHandle order;
+};
+
+inline OrderHeader& Order::Header() const
+{
+  return (*headers)[index];
+}
+
+inline std::ostream& operator<<(std::ostream& stream, const Operation& operation)
+{
+  // indexed by enum value, so keep in declaration order
+  static constexpr std::array<std::string_view, 5> typeNames {
+    "InsertOrder",
+    "InsertQuote",
+    "AmendOrder",
+    "DeleteOrder",
+    "DeleteQuote"
+  };
+  static constexpr std::array<std::string_view, 4> stateNames {
+    "Initial",
+    "Queued",
+    "SentToMarket",
+    "Acked"
+  };
+
+  if (!stream)
+    return stream; // --quiet, don't pay for the formatting
+  stream << "Type: " << typeNames[(int)operation.operationType] << ", state: " << stateNames[(int)operation.operationState] << ", ";
+  if (IsQuote(operation))
+  {
+    stream << operation.quotePayload.bidQty << "@" << operation.quotePayload.bidPrice << "--" << operation.quotePayload.askQty << "@" << operation.quotePayload.askPrice;
+  }
+  else
+  {
+    stream << operation.orderPayload.qty << "@" << operation.orderPayload.price;
+  }
+  return stream;
+}
+
+// an order and its operation history, for logging
+struct PrintedOrder
+{
+  const Order& order;
+  const SlotMap<Operation>& operationSlots;
+};
+
+inline std::ostream& operator<<(std::ostream& stream, const PrintedOrder& printed)
+{
+  const Order& order = printed.order;
+  static constexpr std::array<std::string_view, 4> stateNames {
+    "PriorToMarket",
+    "OnMarket",
+    "DeleteSentToMarket",
+    "Finalised"
+  };
+
+  if (!stream)
+    return stream; // --quiet, and the history walk is the dearest part of a log line
+  stream << "State: " << stateNames[(int)order.Header().orderState] << ", Side: " << (order.Header().side == Side::Buy ? "Buy" : "Sell")
+         << ", " << order.qty << "@" << order.price << ", operations: ";
+  for (auto& operation : order.operations)
+    stream << "[ " << printed.operationSlots[operation] << " ]";
+  return stream;
+}
+
+struct Quote
+{
+  int buyPrice;
+  int buyQty;
+  int sellPrice;
+  int sellQty;
+  std::vector<Operation> operations;
+};
+
+// Send latency in throttle windows, i.e. how many drains an operation waited through before it went
+// out. A conflated operation counts from when it was first queued.
+struct LatencyHistogram
+{
+  std::array<long, 64> counts {}; // the last bucket also collects anything slower
+
+  void Record(uint32_t windows)
+  {
+    ++counts[std::min<size_t>(windows, counts.size() - 1)];
+  }
+
+  long Total() const
+  {
+    long total = 0;
+    for (long count : counts)
+      total += count;
+    return total;
+  }
+
+  // smallest latency at least the given fraction of sends were within
+  size_t Percentile(double fraction) const
+  {
+    long wanted = std::ceil(fraction * Total());
+    long seen = 0;
+    for (size_t windows = 0; windows < counts.size(); ++windows)
+    {
+      seen += counts[windows];
+      if (seen >= wanted && seen > 0)
+        return windows;
+    }
+    return 0;
+  }
+};
+
+// Source of every simulated decision (actions, prices, throttle state, acks). Normally a seeded
+// engine; a fuzzer can instead replay its input bytes so each byte steers the next decision.
+class DecisionSource
+{
+public:
+  using result_type = std::default_random_engine::result_type;
+  static constexpr result_type min() { return std::default_random_engine::min(); }
+  static constexpr result_type max() { return std::default_random_engine::max(); }
+
+  explicit DecisionSource(result_type seed)
+    : engine(seed)
+  {
+  }
+
+  result_type operator()()
+  {
+    if (!replaying)
+      return engine();
+    if (replayPosition == replaySize)
+      return min(); // input exhausted, keep answering so the current step can finish
+    return min() + (max() - min()) / UINT8_MAX * replayData[replayPosition++]; // spread over the full range
+  }
+
+  void seed(result_type value)
+  {
+    engine.seed(value);
+  }
+
+  void Replay(const uint8_t* data, size_t size)
+  {
+    replaying = true;
+    replayData = data;
+    replaySize = size;
+    replayPosition = 0;
+  }
+
+  bool Exhausted() const
+  {
+    return replaying && replayPosition == replaySize;
+  }
+
+  // decisions replayed so far
+  size_t Position() const
+  {
+    return replayPosition;
+  }
+
+private:
+  std::default_random_engine engine;
+  bool replaying = false;
+  const uint8_t* replayData = nullptr;
+  size_t replaySize = 0;
+  size_t replayPosition = 0;
+};
+
+// Per side price ordering, so that side specific checks are instantiated without runtime branching.
+// "Better" is the more aggressive of two prices, "Through" is whether a price on this side would
+// trade against a price on the opposite side.
+template <Side S>
+struct SideTraits;
+
+template <>
+struct SideTraits<Side::Buy>
+{
+  static constexpr Side Opposite = Side::Sell;
+  static constexpr const char* Name = "Buy";
+  static constexpr const char* LegName = "bid";
+  static constexpr int WorstPrice = std::numeric_limits<int>::min();
+  static int Better(int a, int b) { return std::max(a, b); }
+  static bool Through(int price, int oppositePrice) { return price >= oppositePrice; }
+  static int BestLevel(uint64_t levels) { return levels ? 63 - std::countl_zero(levels) : WorstPrice; }
+  static int QuotePrice(const Operation& quote) { return quote.quotePayload.bidPrice; }
+  static int QuoteQty(const Operation& quote) { return quote.quotePayload.bidQty; }
+};
+
+template <>
+struct SideTraits<Side::Sell>
+{
+  static constexpr Side Opposite = Side::Buy;
+  static constexpr const char* Name = "Sell";
+  static constexpr const char* LegName = "ask";
+  static constexpr int WorstPrice = std::numeric_limits<int>::max();
+  static int Better(int a, int b) { return std::min(a, b); }
+  static bool Through(int price, int oppositePrice) { return price <= oppositePrice; }
+  static int BestLevel(uint64_t levels) { return levels ? std::countr_zero(levels) : WorstPrice; }
+  static int QuotePrice(const Operation& quote) { return quote.quotePayload.askPrice; }
+  static int QuoteQty(const Operation& quote) { return quote.quotePayload.askQty; }
+};
+
+// Every price level any live order on a side could be showing: its last acked price, its current
+// price and anything in flight, i.e. the prices GetLivePrice takes the best of. Counted per level,
+// with a bitmap of the occupied levels so the best level is a single bit scan.
+struct ExposureIndex
+{
+  std::array<uint32_t, UpperPrice + 1> counts {};
+  uint64_t occupied = 0;
+};
+
+// Live orders on one side keyed by their live price (see GetLivePrice), best price on top. Each
+// order's header tracks its slot, so a re-keyed or removed order is found without a search.
+template <Side S>
+class LivePriceHeap
+{
+public:
+  static const uint32_t NotInHeap = UINT32_MAX;
+
+  int Best() const
+  {
+    return entries.empty() ? SideTraits<S>::WorstPrice : entries.front().price;
+  }
+
+  int PriceOf(const OrderHeader& header) const
+  {
+    return entries[header.heapSlot].price;
+  }
+
+  bool Holds(const OrderHeader& header, int price) const
+  {
+    return header.heapSlot < entries.size() && &entries[header.heapSlot].order->Header() == &header && entries[header.heapSlot].price == price;
+  }
+
+  // inserts the order, or moves it to its new price
+  void Update(Order& order, int price)
+  {
+    uint32_t slot = order.Header().heapSlot;
+    if (slot == NotInHeap)
+    {
+      entries.push_back(Entry{price, &order});
+      SiftUp(entries.size() - 1);
+      return;
+    }
+    int previousPrice = entries[slot].price;
+    entries[slot].price = price;
+    if (Outranks(price, previousPrice))
+      SiftUp(slot);
+    else
+      SiftDown(slot);
+  }
+
+  void Remove(Order& order)
+  {
+    uint32_t slot = order.Header().heapSlot;
+    if (slot == NotInHeap)
+      return;
+    order.Header().heapSlot = NotInHeap;
+    Entry last = entries.back();
+    entries.pop_back();
+    if (slot == entries.size())
+      return; // removed the last entry
+    entries[slot] = last;
+    if (slot > 0 && Outranks(last.price, entries[(slot - 1) / 2].price))
+      SiftUp(slot);
+    else
+      SiftDown(slot);
+  }
+
+  void Clear()
+  {
+    entries.clear();
+  }
+
+private:
+  struct Entry
+  {
+    int price;
+    Order* order;
+  };
+
+  static bool Outranks(int price, int otherPrice)
+  {
+    return price != otherPrice && SideTraits<S>::Better(price, otherPrice) == price;
+  }
+
+  void Place(size_t slot, const Entry& entry)
+  {
+    entries[slot] = entry;
+    entry.order->Header().heapSlot = slot;
+  }
+
+  void SiftUp(size_t slot)
+  {
+    Entry entry = entries[slot];
+    while (slot > 0)
+    {
+      size_t parent = (slot - 1) / 2;
+      if (!Outranks(entry.price, entries[parent].price))
+        break;
+      Place(slot, entries[parent]);
+      slot = parent;
+    }
+    Place(slot, entry);
+  }
+
+  void SiftDown(size_t slot)
+  {
+    Entry entry = entries[slot];
+    while (true)
+    {
+      size_t child = 2 * slot + 1;
+      if (child >= entries.size())
+        break;
+      if (child + 1 < entries.size() && Outranks(entries[child + 1].price, entries[child].price))
+        ++child;
+      if (!Outranks(entries[child].price, entry.price))
+        break;
+      Place(slot, entries[child]);
+      slot = child;
+    }
+    Place(slot, entry);
+  }
+
+  std::vector<Entry> entries;
+};
+
+// how amends were cross checked, see CheckPendingOrderOperation
+struct AmendCheckCounts
+{
+  long qtyOnly = 0; // skipped, price unchanged
+  long passiveReprice = 0; // skipped, no more aggressive than the order's live price
+  long aggressiveReprice = 0; // checked
+};
+
+// amends and quotes folded into an operation already waiting in the throttle
+struct ConflationCounts
+{
+  long amends = 0;
+  long amendsConflated = 0;
+  long quotes = 0; // that passed the cross check
+  long quotesConflated = 0;
+};
+
+inline int OperationCost(const Operation& operation)
+{
+  int cost = OperationTypeCost[(int)operation.operationType];
+  if (operation.operationType == OperationType::InsertQuote)
+    cost *= (operation.quotePayload.bidQty > -1) + (operation.quotePayload.askQty > -1);
+  return cost;
+}
+
+inline bool IsCancel(const Operation& operation)
+{
+  return operation.operationType == OperationType::DeleteOrder || operation.operationType == OperationType::DeleteQuote;
+}
@@ -0,0 +1,26 @@
+#!/bin/sh
+# Build every preset (including the two stage PGO build) and time a fixed, seeded run of each binary.
+# usage: scripts/compare_builds.sh [iterations [seed]]
+set -e
+cd "$(dirname "$0")/.."
+ITERATIONS=${1:-200000}
+SEED=${2:-42}
+
+for preset in debug release release-native; do
+  cmake --preset $preset > /dev/null
+  cmake --build --preset $preset > /dev/null
+done
+
+# instrumented build trains on the workload generator, then the same tree is rebuilt with the profile
+cmake --preset pgo-generate > /dev/null
+cmake --build --preset pgo-generate --clean-first > /dev/null
+./build/pgo/throttling "$ITERATIONS" "$SEED" > /dev/null
+cmake --preset pgo-use > /dev/null
+cmake --build --preset pgo-use > /dev/null
+
+for build in debug release release-native pgo; do
+  start=$(date +%s%N)
+  ./build/$build/throttling "$ITERATIONS" "$SEED" > /dev/null
+  end=$(date +%s%N)
+  printf "%-16s %8d ms\n" "$build" $(( (end - start) / 1000000 ))
+done
@@ -0,0 +1,61 @@
+#!/bin/sh
+# Shrinks a failing decision stream (see --replay) to a minimal one that still fails the same way. The
+# stream is cut where the failure was found, then ever smaller chunks are removed and the bytes left
+# lowered to 0, keeping each change that still fails. libFuzzer's -minimize_crash does the same for the
+# throttling_fuzz target, where clang is available.
+# usage: scripts/shrink.sh binary stream [shrunk stream]
+BINARY=$1
+STREAM=$2
+SHRUNK=${3:-$STREAM.min}
+CANDIDATE=$(mktemp)
+trap 'rm -f "$CANDIDATE"' EXIT
+
+# prints how the stream fails (the broken invariant, sanitizer report, assert or exit status) and the
+# number of decisions it took, or nothing if it doesn't
+failure() {
+  { output=$("$BINARY" --quiet --replay "$1" 2>&1 > /dev/null); status=$?; } 2> /dev/null
+  [ $status -eq 0 ] && return
+  how=$(echo "$output" | grep -m 1 -o -e 'Invariant broken: .*' -e 'ERROR: [A-Za-z]*Sanitizer: [a-z-]*' -e 'Assertion .*' -e 'runtime error: .*' -e 'terminate called .*')
+  decisions=$(echo "$output" | sed -n 's/^In step [0-9]*, at decision \([0-9]*\) of [0-9]*$/\1/p')
+  echo "${how:-exit status $status}"
+  echo "${decisions:-$(wc -c < "$1")}"
+}
+
+# keeps the candidate if it fails as the stream did, cut to the decisions it took
+keep() {
+  result=$(failure "$CANDIDATE")
+  [ "$(echo "$result" | head -n 1)" = "$SIGNATURE" ] || return 1
+  head -c "$(echo "$result" | tail -n 1)" "$CANDIDATE" > "$SHRUNK"
+  size=$(wc -c < "$SHRUNK")
+}
+
+cp "$STREAM" "$CANDIDATE"
+result=$(failure "$CANDIDATE")
+if [ -z "$result" ]; then
+  echo "$STREAM doesn't fail" >&2
+  exit 1
+fi
+SIGNATURE=$(echo "$result" | head -n 1)
+keep
+
+chunk=$((size / 2))
+while [ "$chunk" -ge 1 ]; do
+  offset=0
+  while [ "$offset" -lt "$size" ]; do
+    { head -c "$offset" "$SHRUNK"; tail -c +$((offset + chunk + 1)) "$SHRUNK"; } > "$CANDIDATE"
+    keep || offset=$((offset + chunk))
+  done
+  chunk=$((chunk / 2))
+done
+
+offset=0
+while [ "$offset" -lt "$size" ]; do
+  if [ "$(od -A n -t u1 -j "$offset" -N 1 "$SHRUNK" | tr -d ' ')" != 0 ]; then
+    cp "$SHRUNK" "$CANDIDATE"
+    printf '\000' | dd of="$CANDIDATE" bs=1 seek="$offset" conv=notrunc 2> /dev/null
+    keep
+  fi
+  offset=$((offset + 1))
+done
+
+echo "shrunk $(wc -c < "$STREAM") decisions to $size, failing with: $SIGNATURE"
@@ -0,0 +1,29 @@
+#!/bin/sh
+# Property stress run: replays a random decision stream per seed the way the fuzz target runs it (see
+# --replay), with invariant checks after every step, and shrinks each failing stream to a minimal one.
+# Failing streams are kept in $FAILURES (default stress-failures).
+# usage: scripts/stress.sh [binary [first seed [last seed [decisions]]]]
+BINARY=${1:-./build/release/throttling}
+FIRST_SEED=${2:-1}
+LAST_SEED=${3:-100}
+DECISIONS=${4:-1000000}
+FAILURES=${FAILURES:-stress-failures}
+STREAM=$(mktemp)
+trap 'rm -f "$STREAM"' EXIT
+
+failures=0
+seed=$FIRST_SEED
+while [ "$seed" -le "$LAST_SEED" ]; do
+  "$BINARY" --write-decisions "$STREAM" "$DECISIONS" "$seed" || exit 1
+  if ! "$BINARY" --quiet --replay "$STREAM" > /dev/null 2>&1; then
+    mkdir -p "$FAILURES"
+    cp "$STREAM" "$FAILURES/seed-$seed"
+    "$(dirname "$0")/shrink.sh" "$BINARY" "$FAILURES/seed-$seed" "$FAILURES/seed-$seed.min"
+    echo "seed $seed fails, replay with: $BINARY --replay $FAILURES/seed-$seed.min"
+    { "$BINARY" --quiet --replay "$FAILURES/seed-$seed.min" 2>&1 > /dev/null | sed 's/^/    /'; } 2> /dev/null
+    failures=$((failures + 1))
+  fi
+  seed=$((seed + 1))
+done
+echo "$failures of $((LAST_SEED - FIRST_SEED + 1)) seeds failed"
+[ "$failures" -eq 0 ]
@@ -0,0 +1,47 @@
+#!/bin/sh
+# Parameter sweep over throttle policies: runs every combination of the grids below for each seed as
+# independent simulator processes spread over all cores, then prints one row per combination averaged
+# over the seeds.
+# usage: [WINDOW_UNITS="6 10"] [CANCEL_RESERVE="0 2"] [THROTTLED="0.15"] scripts/sweep.sh [binary [seeds [iterations [--virtual]]]]
+BINARY=${1:-./build/release/throttling}
+SEEDS=${2:-8}
+ITERATIONS=${3:-20000}
+MODE=${4:-}
+WINDOW_UNITS=${WINDOW_UNITS:-"6 10 14"}
+CANCEL_RESERVE=${CANCEL_RESERVE:-"0 2 4"}
+THROTTLED=${THROTTLED:-"0.15"}
+
+RESULTS=$(mktemp -d)
+trap 'rm -rf "$RESULTS"' EXIT
+
+# one line per run: its configuration and where its report goes
+for units in $WINDOW_UNITS; do
+  for reserve in $CANCEL_RESERVE; do
+    for throttled in $THROTTLED; do
+      seed=1
+      while [ "$seed" -le "$SEEDS" ]; do
+        echo "$units $reserve $throttled $seed"
+        seed=$((seed + 1))
+      done
+    done
+  done
+done | xargs -P "$(nproc)" -L 1 sh -c '"$0" --quiet $1 --window-units "$4" --cancel-reserve "$5" --throttled "$6" "$2" "$7" 0 \
+  2> "$3/$4_$5_$6_$7" > /dev/null || echo "run failed: window units $4, cancel reserve $5, throttled $6, seed $7" >&2' \
+  "$BINARY" "$MODE" "$ITERATIONS" "$RESULTS"
+
+printf "%6s %8s %9s %10s %10s %10s %10s %10s\n" units reserve throttled sent "units sent" conflated "cancel p99" "other p99"
+for units in $WINDOW_UNITS; do
+  for reserve in $CANCEL_RESERVE; do
+    for throttled in $THROTTLED; do
+      cat "$RESULTS/${units}_${reserve}_${throttled}"_* | awk -v units="$units" -v reserve="$reserve" -v throttled="$throttled" '
+        /^Send latency/ { gsub(/[(),]/, ""); runs++; cancelP99 += $10; otherP99 += $21; sent += $11 + $22 }
+        /^Session/ { unitsSent += $5 }
+        /^Conflated/ { conflated += $6 + $10; conflatable += $8 + $12 }
+        END {
+          if (!runs) exit
+          printf "%6s %8s %9s %10d %10d %9.1f%% %10.1f %10.1f\n", units, reserve, throttled, sent / runs, unitsSent / runs,
+                 conflatable ? 100 * conflated / conflatable : 0, cancelP99 / runs, otherP99 / runs
+        }'
+    done
+  done
+done
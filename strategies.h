@@ -0,0 +1,40 @@
+// Strategies written as coroutines against the order manager's strategy API.
+#pragma once
+
+#include <random>
+
+#include "order_manager.h"
+#include "strategy_task.h"
+
+// Works one order at a time on behalf of `strategy`: inserts it, reprices it a few times, each amend
+// going out once the last has left the throttle, then deletes it and waits for the delete's ack before
+// starting on the next. An insert that would cross is retried after the next throttle window.
+inline StrategyTask WorkOrders(OrderManager& manager, uint8_t strategy, DecisionSource& random_engine)
+{
+  std::uniform_int_distribution<> price(1, UpperPrice);
+  std::uniform_int_distribution<> qty(1, UpperVolume);
+  std::uniform_int_distribution<> side((int)Side::Buy, (int)Side::Sell);
+  std::uniform_int_distribution<> amends(0, 3);
+  for (;;)
+  {
+    OperationHandle insert = manager.InsertOrder(strategy, (Side)side(random_engine), price(random_engine), qty(random_engine));
+    OrderHandle order = manager.OrderFor(insert);
+    if (co_await manager.Acked(insert) == OperationOutcome::Discarded)
+    {
+      co_await manager.NextWindow();
+      continue;
+    }
+
+    for (int remaining = amends(random_engine); remaining > 0 && manager.IsLive(order); --remaining)
+    {
+      OperationHandle amend = manager.AmendOrder(order, price(random_engine), qty(random_engine));
+      if (co_await manager.Sent(amend) == OperationOutcome::Discarded)
+        break; // crossed, and the order manager is deleting the order
+    }
+
+    if (manager.IsLive(order))
+      co_await manager.Acked(manager.DeleteOrder(order));
+    else
+      co_await manager.NextWindow();
+  }
+}
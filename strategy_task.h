@@ -0,0 +1,122 @@
+// Coroutine strategies: a StrategyTask is a strategy written as straight line code that co_awaits its
+// operations being sent or acked, or the next throttle window. The order manager resumes it from its
+// event loop, on the same thread, once what it waits for has happened.
+#pragma once
+
+#include <coroutine>
+#include <exception>
+#include <memory_resource>
+#include <utility>
+
+#include "order_types.h"
+
+class OrderManager;
+
+// what an awaited operation came to
+enum class OperationOutcome : uint8_t
+{
+  Sent, // left the throttle for the exchange
+  Acked,
+  Discarded // rejected by a cross check, dropped from the throttle by a delete, or already freed
+};
+
+enum class StrategyWait : uint8_t
+{
+  Sent, // the operation is sent, acked or discarded
+  Acked, // the operation is acked or discarded
+  Window // the next throttle window has been drained
+};
+
+// A suspended strategy's place in the order manager's list of waiters. Each lives in the frame of the
+// strategy waiting on it, so waiting allocates nothing.
+struct StrategyWaiter
+{
+  StrategyWait wait;
+  OperationOutcome outcome = OperationOutcome::Discarded;
+  OperationHandle operation; // unused for a Window wait
+  std::coroutine_handle<> strategy;
+  StrategyWaiter* next = nullptr;
+};
+
+// Return type of a strategy coroutine. A strategy starts suspended and is handed to
+// OrderManager::Spawn, which owns it from then on. Every strategy takes (OrderManager&, uint8_t strategy,
+// DecisionSource&), the order manager it trades through, its index into Strategies and where it draws
+// its decisions from; its frame is carved out of the order manager's StrategyFrames() rather than the
+// heap. operator new has that fixed signature, rather than being a template over any parameters, so
+// that it pairs with operator delete (gcc's -Wmismatched-new-delete).
+class StrategyTask
+{
+public:
+  struct promise_type
+  {
+    // defined with OrderManager
+    static void* operator new(size_t size, OrderManager& manager, uint8_t strategy, DecisionSource& random_engine);
+
+    static void operator delete(void* frame, size_t size)
+    {
+      (*PoolOf(frame, size))->deallocate(frame, FrameBytes(size), alignof(std::max_align_t));
+    }
+
+    StrategyTask get_return_object()
+    {
+      return StrategyTask(std::coroutine_handle<promise_type>::from_promise(*this));
+    }
+
+    std::suspend_always initial_suspend() noexcept { return {}; }
+    std::suspend_always final_suspend() noexcept { return {}; } // the order manager frees it
+    void return_void() {}
+    void unhandled_exception() { throw; } // out of OrderManager::RunStrategies
+
+  private:
+    static void* Allocate(size_t size, std::pmr::memory_resource* frames)
+    {
+      void* frame = frames->allocate(FrameBytes(size), alignof(std::max_align_t));
+      *PoolOf(frame, size) = frames;
+      return frame;
+    }
+
+    // the pool the frame came from is kept just past the end of the frame
+    static size_t FrameBytes(size_t size)
+    {
+      return PoolOffset(size) + sizeof(std::pmr::memory_resource*);
+    }
+
+    static size_t PoolOffset(size_t size)
+    {
+      return (size + alignof(std::pmr::memory_resource*) - 1) & ~(alignof(std::pmr::memory_resource*) - 1);
+    }
+
+    static std::pmr::memory_resource** PoolOf(void* frame, size_t size)
+    {
+      return reinterpret_cast<std::pmr::memory_resource**>(static_cast<std::byte*>(frame) + PoolOffset(size));
+    }
+  };
+
+  StrategyTask(StrategyTask&& other) noexcept
+    : coroutine(std::exchange(other.coroutine, nullptr))
+  {
+  }
+
+  StrategyTask(const StrategyTask&) = delete;
+  StrategyTask& operator=(const StrategyTask&) = delete;
+
+  ~StrategyTask()
+  {
+    if (coroutine)
+      coroutine.destroy(); // never spawned
+  }
+
+  // hands the coroutine over to its new owner
+  std::coroutine_handle<> Release()
+  {
+    return std::exchange(coroutine, nullptr);
+  }
+
+private:
+  explicit StrategyTask(std::coroutine_handle<promise_type> coroutine)
+    : coroutine(coroutine)
+  {
+  }
+
+  std::coroutine_handle<promise_type> coroutine;
+};
@@ -0,0 +1,66 @@
+// Long run churn of a SlotMap, as a run forever order manager puts its operation slots through: tens of
+// millions of inserts and erases over a few dozen live objects. Every stale handle must stay stale, the
+// slots used must stay bounded by the most ever live, and nothing may throw.
+#include <iostream>
+#include <random>
+#include <vector>
+
+#include "order_types.h"
+
+int main()
+{
+  const long Inserts = 50'000'000;
+  const size_t MostLive = 64;
+
+  SlotMap<long> slots;
+  std::vector<Handle<long>> live;
+  std::vector<long> values;
+  std::vector<Handle<long>> firstHandles(MostLive); // the oldest handle each slot gave out, stale ever since
+  std::mt19937 random(1);
+
+  try
+  {
+    for (long inserted = 0; inserted < Inserts;)
+    {
+      if (live.size() < MostLive && (live.empty() || random() % 2 == 0))
+      {
+        Handle<long> handle = slots.Insert(inserted);
+        if (handle.Index() >= MostLive)
+        {
+          std::cerr << "Insert " << inserted << " used slot " << handle.Index() << " with at most " << MostLive << " live" << std::endl;
+          return 1;
+        }
+        Handle<long>& first = firstHandles[handle.Index()];
+        if (!first)
+          first = handle;
+        else if (slots.Contains(first))
+        {
+          std::cerr << "Stale handle to slot " << handle.Index() << " valid again after " << inserted << " inserts" << std::endl;
+          return 1;
+        }
+        live.push_back(handle);
+        values.push_back(inserted++);
+      }
+      else
+      {
+        size_t erased = random() % live.size();
+        if (!slots.Contains(live[erased]) || slots[live[erased]] != values[erased])
+        {
+          std::cerr << "Live handle lost its object after " << inserted << " inserts" << std::endl;
+          return 1;
+        }
+        slots.Erase(live[erased]);
+        live[erased] = live.back();
+        live.pop_back();
+        values[erased] = values.back();
+        values.pop_back();
+      }
+    }
+  }
+  catch (const std::exception& exception)
+  {
+    std::cerr << "Threw " << exception.what() << std::endl;
+    return 1;
+  }
+  return 0;
+}
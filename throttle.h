@@ -0,0 +1,387 @@
+// Per session exchange throttle: one queue per strategy on each session, drained a window at a time
+// with the deletes first and the rest shared out by deficit round robin.
+#pragma once
+
+#include <functional>
+
+#include "order_types.h"
+
+// throttle policy, settable from the command line for parameter sweeps
+struct ThrottlePolicy
+{
+  int maxThrottleUnitsPerWindow = 10;
+  int cancelReserveUnits = 2; // slice of each window only deletes may use
+  double likelihoodOfBeingThrottled = 0.15;
+};
+
+// a strategy's part of a session's throttle, newest operation last
+struct StrategyQueue
+{
+  std::vector<OperationHandle> operations;
+  int deficit = 0; // units it may still send, carried between drains while it has a backlog
+};
+
+struct SendStats
+{
+  long sent = 0;
+  long unitsSent = 0;
+  LatencyHistogram latency; // every send, queued or not
+};
+
+// One exchange session with its own throttle. An order stays on the session it was placed on, so its
+// operations conflate and go out in order there.
+struct Session
+{
+  std::array<StrategyQueue, Strategies.size()> queues;
+  int cancelReserve = 0; // reserved units left in the current window
+  bool closed = false; // as last published to throttle subscribers
+  long inFlight = 0; // sent, still waiting for an ack
+  SendStats stats;
+};
+
+// What strategies are told about a session's throttle. It is closed while anything is queued, as
+// everything sent on the session then has to queue behind it.
+struct ThrottleState
+{
+  size_t session;
+  bool closed;
+  size_t queueDepth; // operations waiting
+  int queuedUnits;
+  double expectedWindowsToSlot; // for an operation queued now, assuming it waits behind everything
+};
+
+class Throttle
+{
+public:
+  Throttle(const ThrottlePolicy& policy, SlotMap<Order>& orderSlots, SlotMap<Operation>& operationSlots, DecisionSource& random_engine)
+    : policy(policy), orderSlots(orderSlots), operationSlots(operationSlots), random_engine(random_engine)
+  {
+    for (Session& session : sessions)
+      session.cancelReserve = policy.cancelReserveUnits;
+  }
+
+  Throttle(const Throttle&) = delete;
+  Throttle& operator=(const Throttle&) = delete;
+
+  // throttle windows drained so far, the clock send latencies are measured on
+  uint32_t Window() const
+  {
+    return throttleWindow;
+  }
+
+  const std::array<Session, SessionCount>& Sessions() const
+  {
+    return sessions;
+  }
+
+  static size_t QueuedOperationCount(const Session& session)
+  {
+    size_t count = 0;
+    for (const StrategyQueue& queue : session.queues)
+      count += queue.operations.size();
+    return count;
+  }
+
+  Session& SessionFor(const Order& order)
+  {
+    return sessions[order.Header().session];
+  }
+
+  StrategyQueue& QueueFor(const Order& order)
+  {
+    return SessionFor(order).queues[order.Header().strategy];
+  }
+
+  // those of the operation's order
+  Session& SessionFor(const Operation& operation)
+  {
+    return SessionFor(orderSlots[operation.order]);
+  }
+
+  StrategyQueue& QueueFor(const Operation& operation)
+  {
+    return QueueFor(orderSlots[operation.order]);
+  }
+
+  ThrottleState GetState(const Session& session)
+  {
+    ThrottleState state {size_t(&session - sessions.data()), false, 0, 0, 0};
+    for (const StrategyQueue& queue : session.queues)
+    {
+      state.queueDepth += queue.operations.size();
+      for (OperationHandle handle : queue.operations)
+        state.queuedUnits += OperationCost(operationSlots[handle]);
+    }
+    state.closed = state.queueDepth > 0;
+    // windows average half the maximum, less what is reserved for cancels
+    double unitsPerWindow = std::max(policy.maxThrottleUnitsPerWindow / 2.0 - policy.cancelReserveUnits, 1.0);
+    state.expectedWindowsToSlot = state.closed ? (state.queuedUnits + 1) / unitsPerWindow : 0;
+    return state;
+  }
+
+  // Expected drains until a queued operation goes out. Queued deletes go first and may use the whole
+  // window. Anything else then waits for its strategy's deficit round robin share of the rest of each
+  // window to cover it and whatever its strategy queued after it, less the credit already banked.
+  double ExpectedWindowsToSend(OperationHandle handle)
+  {
+    const Operation& operation = operationSlots[handle];
+    Session& session = SessionFor(operation);
+    int cancelUnits = 0;
+    int backloggedWeight = 0;
+    for (size_t strategy = 0; strategy < session.queues.size(); ++strategy)
+    {
+      bool backlogged = false;
+      for (OperationHandle queued : session.queues[strategy].operations)
+      {
+        if (IsCancel(operationSlots[queued]))
+          cancelUnits += OperationCost(operationSlots[queued]);
+        else
+          backlogged = true;
+      }
+      if (backlogged)
+        backloggedWeight += Strategies[strategy].weight;
+    }
+    if (IsCancel(operation))
+      return cancelUnits / (policy.maxThrottleUnitsPerWindow / 2.0);
+
+    const StrategyQueue& queue = QueueFor(operation);
+    int unitsAhead = 0; // its own and those of newer operations, which its strategy sends first
+    for (auto it = queue.operations.rbegin(); it != queue.operations.rend(); ++it)
+    {
+      if (!IsCancel(operationSlots[*it]))
+        unitsAhead += OperationCost(operationSlots[*it]);
+      if (*it == handle)
+        break;
+    }
+    double share = double(Strategies[orderSlots[operation.order].Header().strategy].weight) / backloggedWeight;
+    double unitsPerWindow = std::max(policy.maxThrottleUnitsPerWindow / 2.0 - policy.cancelReserveUnits, 1.0);
+    return (cancelUnits + std::max(unitsAhead - queue.deficit, 0) / share) / unitsPerWindow;
+  }
+
+  // called when a session's throttle closes or reopens
+  void Subscribe(std::function<void(const ThrottleState&)> subscriber)
+  {
+    throttleSubscribers.push_back(std::move(subscriber));
+  }
+
+  // can the operation go out now
+  bool Check(const Operation& operation)
+  {
+    Session& session = SessionFor(operation);
+    int cost = OperationCost(operation);
+    if (!QueuedOperationCount(session))
+    {
+      // from time to time simulate window becoming closed, each unit the operation costs has to fit
+      std::bernoulli_distribution distribution(std::pow(1 - policy.likelihoodOfBeingThrottled, cost));
+      if (distribution(random_engine))
+        return true;
+    }
+    // it would have to queue, unless it is a cancel the reserve still has room for
+    if (IsCancel(operation) && cost <= session.cancelReserve)
+    {
+      session.cancelReserve -= cost; // goes straight out, whatever is backlogged
+      ++cancelsFromReserve;
+      return true;
+    }
+    return false;
+  }
+
+  // Callers have already conflated or discarded anything the order had queued: amends and quotes are
+  // folded into the queued operation, deletes remove it.
+  void Push(OperationHandle handle)
+  {
+    Operation& operation = operationSlots[handle];
+    std::vector<OperationHandle>& queue = QueueFor(operation).operations;
+    assert(std::none_of(queue.begin(), queue.end(), [this, &operation](OperationHandle queued) { return operationSlots[queued].order == operation.order; }));
+    queue.push_back(handle);
+    operation.operationState = OperationState::Queued;
+    std::cout << "Operation throttled: " << operation << ", queue size now: " << QueuedOperationCount(SessionFor(operation)) << std::endl;
+    Publish(SessionFor(operation));
+  }
+
+  // takes whatever the order has queued out of the throttle
+  void Remove(Order* order)
+  {
+    std::vector<OperationHandle>& queue = QueueFor(*order).operations;
+    queue.erase(std::remove_if(queue.begin(), queue.end(), [this, order](OperationHandle handle)
+    {
+      const Operation& operation = operationSlots[handle];
+      if (operation.order == order->Header().order)
+      {
+        std::cout << "Removing operation from throttle: " << operation << std::endl;
+        return true;
+      }
+      return false;
+    }), queue.end());
+    Publish(SessionFor(*order));
+  }
+
+  // the session with the fewest units queued, then the fewest operations in flight
+  size_t LeastLoadedSession()
+  {
+    size_t best = 0;
+    int bestUnits = GetState(sessions[0]).queuedUnits;
+    for (size_t session = 1; session < sessions.size(); ++session)
+    {
+      int units = GetState(sessions[session]).queuedUnits;
+      if (units < bestUnits || (units == bestUnits && sessions[session].inFlight < sessions[best].inFlight))
+      {
+        best = session;
+        bestUnits = units;
+      }
+    }
+    return best;
+  }
+
+  // books a send against its session and strategy
+  void RecordSend(const Operation& operation)
+  {
+    uint32_t latency = throttleWindow - operation.createdWindow;
+    (IsCancel(operation) ? cancelLatency : otherLatency).Record(latency);
+    const OrderHeader& header = orderSlots[operation.order].Header();
+    Session& session = sessions[header.session];
+    ++session.inFlight;
+    for (SendStats* stats : {&session.stats, &strategyStats[header.strategy]})
+    {
+      ++stats->sent;
+      stats->unitsSent += OperationCost(operation);
+      stats->latency.Record(latency);
+    }
+  }
+
+  void RecordAck(const Order& order)
+  {
+    --SessionFor(order).inFlight;
+  }
+
+  // one throttle window passes on every session, send is called with each operation it lets out
+  template <typename Send>
+  void ProcessWindow(Send&& send)
+  {
+    ++throttleWindow;
+    for (Session& session : sessions)
+      DrainSession(session, send);
+  }
+
+  LatencyHistogram cancelLatency;
+  LatencyHistogram otherLatency; // inserts, amends and quotes
+  long cancelsFromReserve = 0;
+  std::array<SendStats, Strategies.size()> strategyStats;
+
+private:
+  // tells subscribers if the session's throttle closed or reopened since they last heard
+  void Publish(Session& session)
+  {
+    if (session.closed == (QueuedOperationCount(session) > 0))
+      return;
+    ThrottleState state = GetState(session);
+    session.closed = state.closed;
+    std::cout << "Session " << state.session << " throttle " << (state.closed ? "closed" : "reopened") << ", queue depth " << state.queueDepth
+              << ", expected windows to a slot " << state.expectedWindowsToSlot << std::endl;
+    for (auto& subscriber : throttleSubscribers)
+      subscriber(state);
+  }
+
+  // Sends a queued operation and takes it out of its queue, returning the iterator to carry on from
+  template <typename Send>
+  std::vector<OperationHandle>::reverse_iterator PopFromThrottle(std::vector<OperationHandle>& queue, std::vector<OperationHandle>::reverse_iterator it, Send& send)
+  {
+    OperationHandle handle = *it;
+    std::cout << "Operation popped from throttle, " << operationSlots[handle] << std::endl;
+    send(handle);
+    return std::vector<OperationHandle>::reverse_iterator(queue.erase(std::next(it).base()));
+  }
+
+  template <typename Send>
+  void DrainSession(Session& session, Send& send)
+  {
+    if (!QueuedOperationCount(session))
+    {
+      session.cancelReserve = policy.cancelReserveUnits;
+      return;
+    }
+
+    std::cout << "Session " << &session - sessions.data() << " throttle queue contains: ";
+    for (const StrategyQueue& queue : session.queues)
+      for (OperationHandle handle : queue.operations)
+        std::cout << operationSlots[handle];
+    std::cout << std::endl;
+
+    // units free in this window; greedy fill by priority, anything that no longer fits is passed over
+    // for a cheaper operation further along
+    std::uniform_int_distribution<> distribution(0, policy.maxThrottleUnitsPerWindow);
+    int window = distribution(random_engine);
+    int reserve = std::min(policy.cancelReserveUnits, window);
+    // deletes first whoever they belong to, they may use the whole window
+    for (StrategyQueue& queue : session.queues)
+    {
+      for (auto it = queue.operations.rbegin(); it != queue.operations.rend();)
+      {
+        const Operation& operation = operationSlots[*it];
+        int cost = OperationCost(operation);
+        if (!IsCancel(operation) || cost > window)
+        {
+          ++it;
+          continue;
+        }
+        it = PopFromThrottle(queue.operations, it, send);
+        window -= cost;
+      }
+    }
+    // whatever of the reserve the queued deletes left stays open for new cancels until the next drain
+    session.cancelReserve = std::min(reserve, window);
+    window -= session.cancelReserve;
+
+    // Deficit round robin over everything else: each round credits every backlogged strategy its weight,
+    // and each sends what its credit and the window allow, newest first. Rounds go on while anything left
+    // would fit the window.
+    bool anythingFits = true;
+    while (anythingFits)
+    {
+      anythingFits = false;
+      for (size_t strategy = 0; strategy < session.queues.size(); ++strategy)
+      {
+        StrategyQueue& queue = session.queues[strategy];
+        bool backlogged = false;
+        // capped so that a long wait behind a closed window doesn't bank a burst
+        queue.deficit = std::min(queue.deficit + Strategies[strategy].weight, Strategies[strategy].weight + policy.maxThrottleUnitsPerWindow);
+        for (auto it = queue.operations.rbegin(); it != queue.operations.rend();)
+        {
+          const Operation& operation = operationSlots[*it];
+          int cost = OperationCost(operation);
+          if (IsCancel(operation))
+          {
+            ++it;
+            continue;
+          }
+          backlogged = true;
+          if (cost > window)
+          {
+            ++it;
+            continue;
+          }
+          anythingFits = true;
+          if (cost > queue.deficit)
+          {
+            ++it;
+            continue;
+          }
+          it = PopFromThrottle(queue.operations, it, send);
+          window -= cost;
+          queue.deficit -= cost;
+        }
+        if (!backlogged)
+          queue.deficit = 0; // credit isn't banked while there's nothing to send
+      }
+    }
+    Publish(session);
+  }
+
+  ThrottlePolicy policy;
+  SlotMap<Order>& orderSlots; // the order manager's
+  SlotMap<Operation>& operationSlots;
+  DecisionSource& random_engine;
+  std::array<Session, SessionCount> sessions;
+  uint32_t throttleWindow = 0;
+  std::vector<std::function<void(const ThrottleState&)>> throttleSubscribers;
+};